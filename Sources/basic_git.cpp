@@ -1,28 +1,60 @@
 #include "constants.h"
 #include "basic_git.h"
+#include "blob_dedupe.h"
 #include "options.h"
+#include "filesystem.h"
+#include "plan.h"
+#include "prefetch.h"
+#include "timings.h"
+#include "trace.h"
 #include <git2.h>
 #include <stdio.h>
+#include <string.h>
 
-void check_lg2(int error, const char *message, const char *extra) {
+namespace {
+	thread_local char last_error[1024];
+	thread_local bool last_error_transient = false;
+}
+
+int check_lg2(int error, const char *message, const char *extra) {
 	const git_error *lg2err;
 	const char *lg2msg = "", *lg2spacer = "";
 
 	if (!error)
-		return;
+		return 0;
 
+	last_error_transient = false;
 	if ((lg2err = giterr_last()) != NULL && lg2err->message != NULL) {
 		lg2msg = lg2err->message;
 		lg2spacer = " - ";
+		last_error_transient = lg2err->klass == GITERR_NET || lg2err->klass == GITERR_SSL || lg2err->klass == GITERR_SSH;
 	}
 
-	if (extra) fprintf(stderr, "%s '%s' [%d]%s%s\n", message, extra, error, lg2spacer, lg2msg);
-	else fprintf(stderr, "%s [%d]%s%s\n", message, error, lg2spacer, lg2msg);
+	if (extra) snprintf(last_error, sizeof(last_error), "%s '%s' [%d]%s%s", message, extra, error, lg2spacer, lg2msg);
+	else snprintf(last_error, sizeof(last_error), "%s [%d]%s%s", message, error, lg2spacer, lg2msg);
+	fprintf(stderr, "%s\n", last_error);
+
+	giterr_clear();
+	return error;
+}
+
+int report_error(const char* message) {
+	snprintf(last_error, sizeof(last_error), "%s", message);
+	last_error_transient = false;
+	return GIT_ERROR;
+}
+
+const char* last_error_message() {
+	return last_error;
+}
 
-	exit(1);
+bool last_error_is_transient() {
+	return last_error_transient;
 }
 
 int transfer_progress(const git_transfer_progress* stats, void* payload) {
+	if (payload != NULL) trace_fetch_progress((FetchTrace*)payload, stats->received_objects, stats->total_objects);
+	sample_memory();
 	if (stats->received_objects < stats->total_objects) {
 		printf("#%s: Received %i of %i objects (%i Bytes).\n", name, stats->received_objects, stats->total_objects, stats->received_bytes);
 	}
@@ -33,125 +65,875 @@ int transfer_progress(const git_transfer_progress* stats, void* payload) {
 }
 
 int get_credentials(git_cred** cred, const char* url, const char* username_from_url, unsigned int allowed_types, void* payload) {
-	Server* server = 0;
 	for (int i = 0; servers[i] != 0; ++i) {
+		// The server's own credentials never go to the mirror, it is reached over plain HTTP
+		if (servers[i]->mirror[0] != 0 && starts_with(url, servers[i]->mirror)) {
+			if (servers[i]->mirror_user[0] == 0) return 1;
+			git_cred_userpass_plaintext_new(cred, servers[i]->mirror_user, servers[i]->mirror_pass);
+			return 0;
+		}
 		if (starts_with(url, servers[i]->base_url)) {
-			server = servers[i];
-			break;
+			git_cred_userpass_plaintext_new(cred, servers[i]->user, servers[i]->pass);
+			return 0;
 		}
 	}
-	if (server == 0) return 1;
-	git_cred_userpass_plaintext_new(cred, server->user, server->pass);
-	return 0;
+	return 1;
 }
 
 int check_certificate(git_cert* cert, int valid, const char* host, void* payload) {
 	return 1;
 }
 
-void pull(git_repository** repo, const char* path) {
-	git_reference* current_branch;
-	git_reference* upstream;
-	git_buf remote_name = { 0 };
-	git_remote* remote;
+namespace {
+	// Remotes keep the server's URL, the mirror from options.json is only substituted when fetching,
+	// so a clone keeps working when its server's mirror is removed again.
+	void mirrored_url(const char* url, char* mirrored) {
+		strcpy(mirrored, url);
+		for (int i = 0; servers[i] != 0; ++i) {
+			size_t length = strlen(servers[i]->base_url);
+			if (servers[i]->mirror[0] == 0 || length == 0 || !starts_with(url, servers[i]->base_url)) continue;
+			if (strlen(servers[i]->mirror) + strlen(&url[length]) >= max_url_length) continue;
+			strcpy(mirrored, servers[i]->mirror);
+			strcat(mirrored, &url[length]);
+			return;
+		}
+	}
 
-	check_lg2(git_repository_open_ext(repo, path, 0, NULL), "failed to open repo", NULL);
-	check_lg2(git_repository_head(&current_branch, *repo), "failed to lookup current branch", NULL);
-	check_lg2(git_branch_upstream(&upstream, current_branch), "failed to get upstream branch", NULL);
-	check_lg2(git_branch_remote_name(&remote_name, *repo, git_reference_name(upstream)), "failed to get the reference's upstream", NULL);
-	check_lg2(git_remote_lookup(&remote, *repo, remote_name.ptr), "failed to load remote", NULL);
-	git_buf_free(&remote_name);
+	// The remote which fetches of remote connect to. It is anonymous when the URL goes to a mirror,
+	// so fetches through it have to pass their refspecs and the name is taken from remote.
+	int fetch_remote(git_remote** connection, git_remote* remote) {
+		const char* url = git_remote_url(remote);
+		char fetch_url[max_url_length];
+		if (url != NULL && strlen(url) < max_url_length) {
+			mirrored_url(url, fetch_url);
+			if (strcmp(fetch_url, url) != 0) return check_lg2(git_remote_create_anonymous(connection, git_remote_owner(remote), fetch_url), "failed to create remote", fetch_url);
+		}
+		return check_lg2(git_remote_dup(connection, remote), "failed to copy remote", NULL);
+	}
 
-	git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
-	callbacks.credentials = get_credentials;
-	callbacks.transfer_progress = transfer_progress;
-	callbacks.certificate_check = check_certificate;
-	git_remote_connect(remote, GIT_DIRECTION_FETCH, &callbacks, NULL);
-	
-	check_lg2(git_remote_fetch(remote, NULL, NULL, NULL), "failed to fetch from upstream", NULL);
+	// When a prefetch already received what the remote advertises for the upstream branch,
+	// the remote-tracking branches are moved to the prefetched commits instead of fetching.
+	bool use_prefetch(git_repository* repo, git_remote* remote, git_remote* connection, const char* upstream_name) {
+		const git_remote_head** heads;
+		size_t count;
+		if (git_remote_ls(&heads, &count, connection) != 0) {
+			giterr_clear();
+			return false;
+		}
 
-	{
+		bool upstream_prefetched = false;
+		for (size_t i = 0; i < count; ++i) {
+			if (!starts_with(heads[i]->name, "refs/heads/")) continue;
+			char prefetch_name[max_name_length * 2];
+			if (strlen("refs/prefetch/") + strlen(git_remote_name(remote)) + strlen(heads[i]->name) >= sizeof(prefetch_name)) continue;
+			strcpy(prefetch_name, "refs/prefetch/");
+			strcat(prefetch_name, git_remote_name(remote));
+			strcat(prefetch_name, &heads[i]->name[strlen("refs/heads")]);
+			git_oid id;
+			if (git_reference_name_to_id(&id, repo, prefetch_name) != 0 || !git_oid_equal(&id, &heads[i]->oid)) {
+				giterr_clear();
+				continue;
+			}
+
+			for (size_t j = 0; j < git_remote_refspec_count(remote); ++j) {
+				const git_refspec* refspec = git_remote_get_refspec(remote, j);
+				if (git_refspec_direction(refspec) != GIT_DIRECTION_FETCH || !git_refspec_src_matches(refspec, heads[i]->name)) continue;
+				git_buf tracking_name = { 0 };
+				git_reference* ref = NULL;
+				if (git_refspec_transform(&tracking_name, refspec, heads[i]->name) == 0
+					&& git_reference_create(&ref, repo, tracking_name.ptr, &id, 1, "prefetch") == 0
+					&& strcmp(tracking_name.ptr, upstream_name) == 0) {
+					upstream_prefetched = true;
+				}
+				giterr_clear();
+				git_reference_free(ref);
+				git_buf_free(&tracking_name);
+				break;
+			}
+		}
+		return upstream_prefetched;
+	}
+
+	int fetch_upstream(git_repository* repo, git_reference* upstream) {
+		git_buf remote_name = { 0 };
+		git_remote* remote = NULL;
+		int error = check_lg2(git_branch_remote_name(&remote_name, repo, git_reference_name(upstream)), "failed to get the reference's upstream", NULL);
+		if (!error) error = check_lg2(git_remote_lookup(&remote, repo, remote_name.ptr), "failed to load remote", NULL);
+		git_buf_free(&remote_name);
+
+		git_remote* connection = NULL;
+		git_strarray refspecs = { 0 };
+		if (!error) error = fetch_remote(&connection, remote);
+		if (!error) error = check_lg2(git_remote_get_fetch_refspecs(&refspecs, remote), "failed to get refspecs", NULL);
+		if (!error) {
+			git_fetch_options options = GIT_FETCH_OPTIONS_INIT;
+			options.callbacks.credentials = get_credentials;
+			options.callbacks.transfer_progress = transfer_progress;
+			options.callbacks.certificate_check = check_certificate;
+			FetchTrace fetch_trace;
+			options.callbacks.payload = &fetch_trace;
+			long long start = now_ms();
+			{
+				TraceSpan span("connect", name);
+				error = check_lg2(git_remote_connect(connection, GIT_DIRECTION_FETCH, &options.callbacks, NULL), "failed to connect to upstream", NULL);
+			}
+			if (!error && use_prefetch(repo, remote, connection, git_reference_name(upstream))) {
+				printf("#%s: Using prefetched objects.\n", name);
+			}
+			else if (!error) {
+				trace_fetch_start(&fetch_trace);
+				error = check_lg2(git_remote_fetch(connection, &refspecs, &options, NULL), "failed to fetch from upstream", NULL);
+				trace_fetch_end(&fetch_trace, name);
+			}
+			add_fetch_time(start, git_remote_stats(connection)->received_bytes);
+		}
+
+		git_strarray_free(&refspecs);
+		git_remote_free(connection);
+		git_remote_free(remote);
+		return error;
+	}
+
+	int fast_forward(git_repository* repo, git_reference* current_branch, const git_oid* id) {
+		printf("#%s: Fast forward\n", name);
+
+		git_object* obj = NULL;
+		int error = check_lg2(git_object_lookup(&obj, repo, id, GIT_OBJ_ANY), "Failed getting new head id.", NULL);
+
+		if (!error) {
+			git_checkout_options options = GIT_CHECKOUT_OPTIONS_INIT;
+			options.checkout_strategy = GIT_CHECKOUT_SAFE;
+			long long start = now_ms();
+			TraceSpan span("checkout", name);
+			error = check_lg2(git_checkout_tree(repo, obj, &options), "Checkout failed.", NULL);
+			add_checkout_time(start);
+		}
+
+		if (!error) {
+			git_reference* newhead = NULL;
+			error = check_lg2(git_reference_set_target(&newhead, current_branch, id, "Fast forwarding"), "Fast forward fail.", NULL);
+			git_reference_free(newhead);
+		}
+
+		git_object_free(obj);
+		return error;
+	}
+
+	// Merges in memory first, so a conflicting merge leaves the work tree alone and a clean one
+	// writes every file once, with the final tree.
+	// upstream was looked up before the fetch, the fetched commit is upstream_id.
+	int merge_normal(git_repository* repo, git_reference* current_branch, git_reference* upstream, const git_oid* upstream_id) {
+		git_commit* parents[2] = { NULL, NULL };
+		git_index* index = NULL;
+		git_oid tree_id, commit_id;
+		git_tree* tree = NULL;
+		git_signature* user = NULL;
+
+		int error = check_lg2(git_commit_lookup(&parents[0], repo, git_reference_target(current_branch)), "failed to lookup first parent", NULL);
+		if (!error) error = check_lg2(git_commit_lookup(&parents[1], repo, upstream_id), "failed to lookup second parent", NULL);
+		if (!error) {
+			TraceSpan span("merge", name);
+			error = check_lg2(git_merge_commits(&index, repo, parents[0], parents[1], NULL), "failed to merge", NULL);
+		}
+
+		if (!error && git_index_has_conflicts(index)) {
+			printf("#%s: There were conflicts merging, nothing was changed. Please merge manually.\n", name);
+			error = report_error("merge conflicts, the work tree was not changed");
+		}
+
+		if (!error) error = check_lg2(git_index_write_tree_to(&tree_id, index, repo), "failed to write tree", NULL);
+		if (!error) error = check_lg2(git_tree_lookup(&tree, repo, &tree_id), "failed to lookup tree", NULL);
+
+		// The commit is created without moving the branch, which only happens after the checkout succeeded
+		if (!error) {
+			TraceSpan span("commit", name);
+			char message[max_name_length * 2];
+			sprintf(message, "Merge remote-tracking branch '%s'\n", git_reference_shorthand(upstream));
+			error = check_lg2(git_signature_default(&user, repo), "failed to get user's ident", NULL);
+			if (!error) error = check_lg2(git_commit_create(&commit_id, repo, NULL, user, user, NULL, message, tree, 2, (const git_commit **)parents), "failed to create commit", NULL);
+		}
+
+		if (!error) {
+			git_checkout_options options = GIT_CHECKOUT_OPTIONS_INIT;
+			options.checkout_strategy = GIT_CHECKOUT_SAFE;
+			long long start = now_ms();
+			TraceSpan span("checkout", name);
+			error = check_lg2(git_checkout_tree(repo, (git_object*)tree, &options), "Checkout failed.", NULL);
+			add_checkout_time(start);
+		}
+
+		if (!error) {
+			git_reference* newhead = NULL;
+			error = check_lg2(git_reference_set_target(&newhead, current_branch, &commit_id, "Merge"), "failed to update branch", NULL);
+			git_reference_free(newhead);
+		}
+
+		git_signature_free(user);
+		git_tree_free(tree);
+		git_index_free(index);
+		git_commit_free(parents[0]);
+		git_commit_free(parents[1]);
+		return error;
+	}
+
+	int merge_upstream(git_repository* repo, git_reference* current_branch, git_reference* upstream) {
 		git_annotated_commit *merge_heads[1];
-		check_lg2(git_annotated_commit_from_ref(&merge_heads[0], *repo, upstream), "failed to create merge head", NULL);
+		int error = check_lg2(git_annotated_commit_from_ref(&merge_heads[0], repo, upstream), "failed to create merge head", NULL);
+		if (error) return error;
 
 		git_merge_analysis_t analysis;
 		git_merge_preference_t preference;
-		git_merge_analysis(&analysis, &preference, *repo, (const git_annotated_commit**)merge_heads, 1);
+		{
+			TraceSpan span("merge analysis", name);
+			error = check_lg2(git_merge_analysis(&analysis, &preference, repo, (const git_annotated_commit**)merge_heads, 1), "failed to analyze merge", NULL);
+		}
+		if (error) {
+			git_annotated_commit_free(merge_heads[0]);
+			return error;
+		}
 
 		if (analysis & GIT_MERGE_ANALYSIS_UP_TO_DATE) {
-			printf("Up to date\n");
+			printf("#%s: Up to date\n", name);
 		}
 		else if (analysis & GIT_MERGE_ANALYSIS_NONE || analysis & GIT_MERGE_ANALYSIS_UNBORN) {
-			printf("No merge possible\n");
+			printf("#%s: No merge possible\n", name);
+			error = report_error("no merge possible");
 		}
 		else if (analysis & GIT_MERGE_ANALYSIS_FASTFORWARD) {
-			printf("Fast forward\n");
-			const git_oid* id = git_annotated_commit_id(merge_heads[0]);
+			error = fast_forward(repo, current_branch, git_annotated_commit_id(merge_heads[0]));
+		}
+		else if (analysis & GIT_MERGE_ANALYSIS_NORMAL) {
+			error = merge_normal(repo, current_branch, upstream, git_annotated_commit_id(merge_heads[0]));
+		}
+		else {
+			printf("#%s: Unknown merge state.\n", name);
+			error = report_error("unknown merge state");
+		}
 
-			git_object* obj;
-			check_lg2(git_object_lookup(&obj, *repo, id, GIT_OBJ_ANY), "Failed getting new head id.", NULL);
+		git_annotated_commit_free(merge_heads[0]);
+		return error;
+	}
+}
 
-			git_checkout_options options = GIT_CHECKOUT_OPTIONS_INIT;
-			options.checkout_strategy = GIT_CHECKOUT_SAFE;
-			check_lg2(git_checkout_tree(*repo, obj, &options), "Checkout failed.", NULL);
+int pull(git_repository** repo, const char* path) {
+	git_reference* current_branch = NULL;
+	git_reference* upstream = NULL;
+
+	int error;
+	{
+		TraceSpan span("open", name);
+		error = check_lg2(git_repository_open_ext(repo, path, 0, NULL), "failed to open repo", NULL);
+	}
+	if (!error) error = check_lg2(git_repository_head(&current_branch, *repo), "failed to lookup current branch", NULL);
+	if (!error) error = check_lg2(git_branch_upstream(&upstream, current_branch), "failed to get upstream branch", NULL);
+	if (!error) error = fetch_upstream(*repo, upstream);
+	if (!error) error = merge_upstream(*repo, current_branch, upstream);
+
+	git_reference_free(upstream);
+	git_reference_free(current_branch);
+	return error;
+}
 
-			git_reference* newhead;
-			check_lg2(git_reference_set_target(&newhead, current_branch, id, "Fast forwarding"), "Fast forward fail.", NULL);
+namespace {
+	struct PrefetchProgress {
+		size_t received_bytes;
+		long long last_idle_check;
+		bool interrupted;
+	};
+
+	// Gives the connection and the repository up as soon as an update starts.
+	int prefetch_progress(const git_transfer_progress* stats, void* payload) {
+		PrefetchProgress* progress = (PrefetchProgress*)payload;
+		long long now = now_ms();
+		if (now - progress->last_idle_check >= 1000) {
+			progress->last_idle_check = now;
+			if (!prefetch_idle()) {
+				progress->interrupted = true;
+				return 1;
+			}
 		}
-		else if (analysis & GIT_MERGE_ANALYSIS_NORMAL) {
-			check_lg2(git_merge(*repo, (const git_annotated_commit**)merge_heads, 1, NULL, NULL), "failed to merge", NULL);
-			{
-				git_index *index;
-				int has_conflicts;
-				check_lg2(git_repository_index(&index, *repo), "failed to load index", NULL);
-				has_conflicts = git_index_has_conflicts(index);
-				git_index_free(index);
-				if (has_conflicts) {
-					printf("There were conflicts merging. Please resolve them and commit.\n");
-				}
-				else {
-					git_index *index;
-					git_buf message = { 0 };
-					git_oid commit_id, tree_id;
-					git_commit *parents[2];
-					git_signature *user;
-					git_tree *tree;
+		limit_bandwidth(stats->received_bytes - progress->received_bytes);
+		progress->received_bytes = stats->received_bytes;
+		return 0;
+	}
+}
+
+int prefetch(git_repository** repo, const char* path) {
+	int error = check_lg2(git_repository_open(repo, path), "failed to open repo", path);
+
+	// The remote which the pull will fetch from
+	char remote_name[max_name_length];
+	strcpy(remote_name, "origin");
+	git_reference* current_branch = NULL;
+	git_reference* upstream = NULL;
+	if (!error && git_repository_head(&current_branch, *repo) == 0 && git_branch_upstream(&upstream, current_branch) == 0) {
+		git_buf name_buffer = { 0 };
+		if (git_branch_remote_name(&name_buffer, *repo, git_reference_name(upstream)) == 0 && strlen(name_buffer.ptr) < max_name_length) {
+			strcpy(remote_name, name_buffer.ptr);
+		}
+		git_buf_free(&name_buffer);
+	}
+	giterr_clear();
+	git_reference_free(upstream);
+	git_reference_free(current_branch);
+
+	git_remote* remote = NULL;
+	git_remote* connection = NULL;
+	if (!error) error = check_lg2(git_remote_lookup(&remote, *repo, remote_name), "failed to load remote", remote_name);
+	if (!error) error = fetch_remote(&connection, remote);
+	if (!error) {
+		char refspec[max_name_length * 2];
+		strcpy(refspec, "+refs/heads/*:refs/prefetch/");
+		strcat(refspec, remote_name);
+		strcat(refspec, "/*");
+		char* refspecs[] = { refspec };
+		git_strarray refspec_array = { refspecs, 1 };
+
+		PrefetchProgress progress;
+		progress.received_bytes = 0;
+		progress.last_idle_check = now_ms();
+		progress.interrupted = false;
+		git_fetch_options options = GIT_FETCH_OPTIONS_INIT;
+		options.callbacks.credentials = get_credentials;
+		options.callbacks.transfer_progress = prefetch_progress;
+		options.callbacks.certificate_check = check_certificate;
+		options.callbacks.payload = &progress;
+		// Tags and FETCH_HEAD are left to the pull
+		options.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+		options.update_fetchhead = 0;
+		long long start = now_ms();
+		error = git_remote_fetch(connection, &refspec_array, &options, "prefetch");
+		if (error && progress.interrupted) {
+			giterr_clear();
+			printf("#%s: Prefetch stopped for an update.\n", name);
+		}
+		else {
+			check_lg2(error, "failed to prefetch", remote_name);
+		}
+		add_fetch_time(start, progress.received_bytes);
+	}
+	git_remote_free(connection);
+	git_remote_free(remote);
+	return error;
+}
+
+namespace {
+	// Present in the .git directory until a clone has received all objects and checked them out.
+	const char* clone_marker = "kitgit-clone";
+
+	struct RemoteRef {
+		char refspec[max_name_length * 2 + 2];
+		char local_name[max_name_length];
+		git_oid id;
+	};
+
+	int fetch_ref(git_remote* remote, char** refspecs, size_t count) {
+		if (count == 0) return 0;
+		git_strarray specs;
+		specs.strings = refspecs;
+		specs.count = count;
+
+		git_fetch_options options = GIT_FETCH_OPTIONS_INIT;
+		options.callbacks.credentials = get_credentials;
+		options.callbacks.transfer_progress = transfer_progress;
+		options.callbacks.certificate_check = check_certificate;
+		options.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_NONE;
+		options.update_fetchhead = 0;
+		FetchTrace fetch_trace;
+		options.callbacks.payload = &fetch_trace;
+		long long start = now_ms();
+		trace_fetch_start(&fetch_trace);
+		int error = check_lg2(git_remote_fetch(remote, &specs, &options, "clone"), "failed to fetch", refspecs[0]);
+		trace_fetch_end(&fetch_trace, name);
+		add_fetch_time(start, git_remote_stats(remote)->received_bytes);
+		return error;
+	}
+
+	// The branch which is checked out is fetched on its own first, the remote's default branch when
+	// branch is NULL, then all other branches and tags in one more fetch. An interrupted clone keeps
+	// the refs of completed fetches, the next attempt only asks for the refs which are still missing
+	// and the negotiation leaves out all objects received so far.
+	int fetch_missing_refs(git_repository* repo, git_remote* remote, const char* branch, char* default_branch) {
+		git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+		callbacks.credentials = get_credentials;
+		callbacks.certificate_check = check_certificate;
+		int error;
+		{
+			TraceSpan span("connect", name);
+			error = check_lg2(git_remote_connect(remote, GIT_DIRECTION_FETCH, &callbacks, NULL), "failed to connect to", git_remote_url(remote));
+		}
+		if (error) return error;
 
-					check_lg2(git_repository_index(&index, *repo), "failed to load index", NULL);
-					check_lg2(git_index_write_tree(&tree_id, index), "failed to write tree", NULL);
-					git_index_free(index);
+		git_buf head = { 0 };
+		default_branch[0] = 0;
+		if (git_remote_default_branch(&head, remote) == 0 && starts_with(head.ptr, "refs/heads/") && strlen(head.ptr) < max_name_length) {
+			strcpy(default_branch, &head.ptr[strlen("refs/heads/")]);
+		}
+		git_buf_free(&head);
+
+		const git_remote_head** heads;
+		size_t count;
+		error = check_lg2(git_remote_ls(&heads, &count, remote), "failed to list remote refs", NULL);
+		if (error) return error;
+
+		// git_remote_fetch reconnects and invalidates heads
+		RemoteRef* refs = new RemoteRef[count];
+		size_t ref_count = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const char* ref_name = heads[i]->name;
+			if (strlen(ref_name) >= max_name_length - 20 || ends_with(ref_name, "^{}")) continue;
+			RemoteRef* ref = &refs[ref_count];
+			if (starts_with(ref_name, "refs/heads/")) {
+				strcpy(ref->local_name, "refs/remotes/origin/");
+				strcat(ref->local_name, &ref_name[strlen("refs/heads/")]);
+			}
+			else if (starts_with(ref_name, "refs/tags/")) {
+				strcpy(ref->local_name, ref_name);
+			}
+			else {
+				continue;
+			}
+			sprintf(ref->refspec, "+%s:%s", ref_name, ref->local_name);
+			git_oid_cpy(&ref->id, &heads[i]->oid);
+			git_oid local;
+			if (git_reference_name_to_id(&local, repo, ref->local_name) == 0 && git_oid_equal(&local, &ref->id)) continue;
+			++ref_count;
+		}
+		git_remote_disconnect(remote);
+
+		char** refspecs = new char*[ref_count + 1];
+		const char* first_branch = branch != NULL ? branch : default_branch;
+		if (first_branch[0] != 0 && strlen(first_branch) < max_name_length - 20) {
+			char first_ref[max_name_length];
+			strcpy(first_ref, "refs/remotes/origin/");
+			strcat(first_ref, first_branch);
+			for (size_t i = 0; !error && i < ref_count; ++i) {
+				if (strcmp(refs[i].local_name, first_ref) != 0) continue;
+				refspecs[0] = refs[i].refspec;
+				error = fetch_ref(remote, refspecs, 1);
+				refs[i].refspec[0] = 0;
+			}
+		}
+		size_t rest_count = 0;
+		for (size_t i = 0; i < ref_count; ++i) {
+			if (refs[i].refspec[0] != 0) refspecs[rest_count++] = refs[i].refspec;
+		}
+		if (!error) error = fetch_ref(remote, refspecs, rest_count);
+
+		delete[] refspecs;
+		delete[] refs;
+		return error;
+	}
+
+	int checkout_branch(git_repository* repo, const char* branch) {
+		char remote_branch[max_name_length];
+		strcpy(remote_branch, "refs/remotes/origin/");
+		strcat(remote_branch, branch);
+		char local_branch[max_name_length];
+		strcpy(local_branch, "refs/heads/");
+		strcat(local_branch, branch);
+
+		git_oid id;
+		git_commit* commit = NULL;
+		git_reference* ref = NULL;
+		int error = check_lg2(git_reference_name_to_id(&id, repo, remote_branch), "failed to find remote branch", remote_branch);
+		if (!error) error = check_lg2(git_commit_lookup(&commit, repo, &id), "failed to lookup commit", remote_branch);
+		// A resumed clone already has the branch and HEAD points to it, libgit2 does not force-create the HEAD branch
+		if (!error && git_reference_lookup(&ref, repo, local_branch) == 0) {
+			git_reference* updated = NULL;
+			error = check_lg2(git_reference_set_target(&updated, ref, &id, "clone"), "failed to update branch", branch);
+			git_reference_free(updated);
+		}
+		else if (!error) {
+			giterr_clear();
+			error = check_lg2(git_branch_create(&ref, repo, branch, commit, 1), "failed to create branch", branch);
+		}
+		if (!error) {
+			strcpy(remote_branch, "origin/");
+			strcat(remote_branch, branch);
+			error = check_lg2(git_branch_set_upstream(ref, remote_branch), "failed to set upstream", remote_branch);
+		}
+		if (!error) error = check_lg2(git_repository_set_head(repo, local_branch), "failed to set HEAD", local_branch);
+		if (!error) {
+			long long start = now_ms();
+			TraceSpan span("checkout", name);
+			error = checkout_deduplicated(repo, commit);
+			add_checkout_time(start);
+		}
+
+		git_reference_free(ref);
+		git_commit_free(commit);
+		return error;
+	}
+
+	int remove_temporary_pack(const char* name, bool dir, void* payload) {
+		if (!dir && starts_with(name, "pack_git2_")) {
+			char path[max_path_length];
+			join_path(path, (const char*)payload, name);
+			remove(path);
+		}
+		return 0;
+	}
+
+	// Left behind by an indexer which was killed while receiving a pack
+	void remove_temporary_packs(git_repository* repo) {
+		char pack_dir[max_path_length];
+		join_path(pack_dir, git_repository_path(repo), "objects");
+		join_path(pack_dir, pack_dir, "pack");
+		list_dir(pack_dir, remove_temporary_pack, pack_dir);
+	}
+}
+
+bool clone_incomplete(const char* path) {
+	char marker[max_path_length];
+	join_path(marker, path, ".git");
+	join_path(marker, marker, clone_marker);
+	return is_file(marker);
+}
+
+namespace {
+	// Opens an interrupted clone or creates a new repository with the marker and origin.
+	int start_clone(git_repository** repo, git_remote** remote, const char* url, const char* path) {
+		int error;
+		if (clone_incomplete(path)) {
+			printf("#%s: Resuming clone.\n", name);
+			error = check_lg2(git_repository_open(repo, path), "failed to open repo", path);
+			if (!error) {
+				remove_temporary_packs(*repo);
+				error = check_lg2(git_remote_lookup(remote, *repo, "origin"), "failed to load remote", NULL);
+			}
+		}
+		else {
+			error = check_lg2(git_repository_init(repo, path, 0), "failed to create repo", path);
+			if (!error) {
+				char marker[max_path_length];
+				join_path(marker, git_repository_path(*repo), clone_marker);
+				FILE* file = fopen(marker, "wb");
+				if (file != NULL) fclose(file);
+				error = check_lg2(git_remote_create(remote, *repo, "origin", url), "failed to create remote", url);
+			}
+		}
+		return error;
+	}
+
+	int finish_clone(git_repository** repo, const char* branch, int error) {
+		// Only check out once the complete object set has arrived
+		if (!error && branch[0] != 0) error = checkout_branch(*repo, branch);
+		if (!error) {
+			char marker[max_path_length];
+			join_path(marker, git_repository_path(*repo), clone_marker);
+			remove(marker);
+		}
+
+		if (error) {
+			git_repository_free(*repo);
+			*repo = NULL;
+		}
+		return error;
+	}
+
+	struct RefCopy {
+		git_repository* from;
+		git_repository* to;
+		int error;
+	};
 
-					check_lg2(git_signature_default(&user, *repo), "failed to get user's ident", NULL);
-					check_lg2(git_repository_message(&message, *repo), "failed to get message", NULL);
+	int copy_ref(const char* ref_name, void* payload) {
+		RefCopy* copy = (RefCopy*)payload;
+		if (!starts_with(ref_name, "refs/remotes/origin/") && !starts_with(ref_name, "refs/tags/")) return 0;
+		if (ends_with(ref_name, "/HEAD")) return 0;
+		git_oid id;
+		if (git_reference_name_to_id(&id, copy->from, ref_name) != 0) return 0;
+		git_reference* ref = NULL;
+		copy->error = check_lg2(git_reference_create(&ref, copy->to, ref_name, &id, 1, "share"), "failed to copy ref", ref_name);
+		git_reference_free(ref);
+		return copy->error;
+	}
+
+	// Borrows all objects of the primary repository through objects/info/alternates
+	// and copies its remote branches and tags.
+	int link_objects(git_repository** repo, git_repository* primary, const char* path) {
+		char info_dir[max_path_length];
+		join_path(info_dir, git_repository_path(*repo), "objects");
+		join_path(info_dir, info_dir, "info");
+		make_dir(info_dir);
+		char alternates[max_path_length];
+		join_path(alternates, info_dir, "alternates");
+		FILE* file = fopen(alternates, "wb");
+		if (file == NULL) return report_error("failed to write objects/info/alternates");
+		char objects[max_path_length];
+		join_path(objects, git_repository_path(primary), "objects");
+		fprintf(file, "%s\n", objects);
+		fclose(file);
+
+		// The object database is only loaded once, reopen so it sees the alternates
+		git_repository_free(*repo);
+		*repo = NULL;
+		int error = check_lg2(git_repository_open(repo, path), "failed to open repo", path);
+		if (error) return error;
+
+		RefCopy copy;
+		copy.from = primary;
+		copy.to = *repo;
+		copy.error = 0;
+		git_reference_foreach_name(primary, copy_ref, &copy);
+		return copy.error;
+	}
+}
+
+int clone(git_repository** repo, const char* url, const char* path, const char* branch) {
+	git_remote* remote = NULL;
+	int error = start_clone(repo, &remote, url, path);
 
-					check_lg2(git_tree_lookup(&tree, *repo, &tree_id), "failed to lookup tree", NULL);
+	git_remote* connection = NULL;
+	char default_branch[max_name_length];
+	if (!error) error = fetch_remote(&connection, remote);
+	if (!error) error = fetch_missing_refs(*repo, connection, branch, default_branch);
+	git_remote_free(connection);
+	git_remote_free(remote);
 
-					check_lg2(git_commit_lookup(&parents[0], *repo, git_reference_target(current_branch)), "failed to lookup first parent", NULL);
-					check_lg2(git_commit_lookup(&parents[1], *repo, git_reference_target(upstream)), "failed to lookup second parent", NULL);
+	if (!error && branch == NULL) branch = default_branch;
+	return finish_clone(repo, branch, error);
+}
+
+int share(git_repository** repo, const char* primary_path, const char* url, const char* path, const char* branch) {
+	git_repository* primary = NULL;
+	git_remote* remote = NULL;
+	char branch_name[max_name_length];
+	branch_name[0] = 0;
 
-					check_lg2(git_commit_create(&commit_id, *repo, "HEAD", user, user, NULL, message.ptr, tree, 2, (const git_commit **)parents), "failed to create commit", NULL);
+	int error = check_lg2(git_repository_open(&primary, primary_path), "failed to open repo", primary_path);
+	if (!error && branch == NULL) {
+		git_reference* head = NULL;
+		error = check_lg2(git_repository_head(&head, primary), "failed to lookup current branch", primary_path);
+		if (!error) strcpy(branch_name, git_reference_shorthand(head));
+		git_reference_free(head);
+	}
+	else if (!error) {
+		strcpy(branch_name, branch);
+	}
+	if (!error) error = start_clone(repo, &remote, url, path);
+	if (!error) error = link_objects(repo, primary, path);
+	git_repository_free(primary);
 
-					git_tree_free(tree);
-					git_signature_free(user);
+	// The primary repository could have fetched the branch long ago, the objects it has are left out
+	// of the negotiation through the alternates so this only receives the new commits
+	if (!error) {
+		char refspec[max_name_length * 2 + 2];
+		sprintf(refspec, "+refs/heads/%s:refs/remotes/origin/%s", branch_name, branch_name);
+		char* refspecs[] = { refspec };
+		git_remote* connection = NULL;
+		error = fetch_remote(&connection, remote);
+		if (!error) error = fetch_ref(connection, refspecs, 1);
+		git_remote_free(connection);
+	}
+	git_remote_free(remote);
+
+	return finish_clone(repo, branch_name, error);
+}
+
+bool remote_head_id(git_oid* id, const char* url, const char* branch) {
+	char ref_name[max_name_length];
+	if (strcmp(branch, "HEAD") == 0) {
+		strcpy(ref_name, "HEAD");
+	}
+	else {
+		strcpy(ref_name, "refs/heads/");
+		strcat(ref_name, branch);
+	}
+
+	char fetch_url[max_url_length];
+	if (strlen(url) >= max_url_length) return false;
+	mirrored_url(url, fetch_url);
+	git_remote* remote;
+	if (git_remote_create_anonymous(&remote, NULL, fetch_url) != 0) return false;
+
+	git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+	callbacks.credentials = get_credentials;
+	callbacks.certificate_check = check_certificate;
+	bool found = false;
+	if (git_remote_connect(remote, GIT_DIRECTION_FETCH, &callbacks, NULL) == 0) {
+		const git_remote_head** heads;
+		size_t count;
+		if (git_remote_ls(&heads, &count, remote) == 0) {
+			for (size_t i = 0; i < count; ++i) {
+				if (strcmp(heads[i]->name, ref_name) == 0) {
+					git_oid_cpy(id, &heads[i]->oid);
+					found = true;
+					break;
 				}
 			}
 		}
+		git_remote_disconnect(remote);
+	}
+	git_remote_free(remote);
+	return found;
+}
+
+int update_mirror(const char* url, const char* path) {
+	git_repository* repo = NULL;
+	git_remote* remote = NULL;
+	int error;
+	if (is_dir(path)) {
+		error = check_lg2(git_repository_open(&repo, path), "failed to open mirror", path);
+		if (!error) error = check_lg2(git_remote_lookup(&remote, repo, "origin"), "failed to load remote", NULL);
+	}
+	else {
+		error = check_lg2(git_repository_init(&repo, path, 1), "failed to create mirror", path);
+		if (!error) error = check_lg2(git_remote_create_with_fetchspec(&remote, repo, "origin", url, "+refs/heads/*:refs/heads/*"), "failed to create remote", url);
+	}
+
+	git_fetch_options options = GIT_FETCH_OPTIONS_INIT;
+	options.callbacks.credentials = get_credentials;
+	options.callbacks.transfer_progress = transfer_progress;
+	options.callbacks.certificate_check = check_certificate;
+	options.download_tags = GIT_REMOTE_DOWNLOAD_TAGS_ALL;
+	long long start = now_ms();
+	if (!error) {
+		TraceSpan span("connect", name);
+		error = check_lg2(git_remote_connect(remote, GIT_DIRECTION_FETCH, &options.callbacks, NULL), "failed to connect to upstream", NULL);
+	}
+	if (!error) {
+		TraceSpan span("fetch", name);
+		error = check_lg2(git_remote_download(remote, NULL, &options), "failed to fetch from upstream", NULL);
+		if (!error) error = check_lg2(git_remote_update_tips(remote, &options.callbacks, 0, GIT_REMOTE_DOWNLOAD_TAGS_ALL, "mirror"), "failed to update refs", NULL);
+		if (!error) error = check_lg2(git_remote_prune(remote, &options.callbacks), "failed to prune refs", NULL);
+	}
+	if (!error) {
+		// Clients take their default branch from the HEAD of the mirror
+		git_buf default_branch = { 0 };
+		if (git_remote_default_branch(&default_branch, remote) == 0) {
+			check_lg2(git_repository_set_head(repo, default_branch.ptr), "failed to set HEAD", default_branch.ptr);
+		}
 		else {
-			printf("Unknown merge state.\n");
+			giterr_clear();
 		}
+		git_buf_free(&default_branch);
+	}
+	if (remote != NULL) {
+		git_remote_disconnect(remote);
+		add_fetch_time(start, git_remote_stats(remote)->received_bytes);
+	}
 
-		git_annotated_commit_free(merge_heads[0]);
+	git_remote_free(remote);
+	git_repository_free(repo);
+	return error;
+}
+
+namespace {
+	int count_changes(git_repository* repo, size_t* count) {
+		git_status_options options = GIT_STATUS_OPTIONS_INIT;
+		options.flags = GIT_STATUS_OPT_EXCLUDE_SUBMODULES;
+		git_status_list* status;
+		int error = check_lg2(git_status_list_new(&status, repo, &options), "failed to get status", NULL);
+		if (error) return error;
+		*count = git_status_list_entrycount(status);
+		git_status_list_free(status);
+		return 0;
 	}
 
-	git_reference_free(upstream);
-	git_reference_free(current_branch);
+	// The advertised commit of the branch which upstream (refs/remotes/<remote>/<branch>) tracks.
+	int advertised_id(git_remote* remote, const char* upstream_name, git_oid* id, bool* found) {
+		char ref_name[max_name_length];
+		const char* branch = &upstream_name[strlen("refs/remotes/") + strlen(git_remote_name(remote)) + 1];
+		strcpy(ref_name, "refs/heads/");
+		strcat(ref_name, branch);
+
+		git_remote* connection = NULL;
+		int error = fetch_remote(&connection, remote);
+		if (error) return error;
+		git_remote_callbacks callbacks = GIT_REMOTE_CALLBACKS_INIT;
+		callbacks.credentials = get_credentials;
+		callbacks.certificate_check = check_certificate;
+		{
+			TraceSpan span("connect", name);
+			error = check_lg2(git_remote_connect(connection, GIT_DIRECTION_FETCH, &callbacks, NULL), "failed to connect to", git_remote_url(connection));
+		}
+
+		const git_remote_head** heads;
+		size_t count;
+		*found = false;
+		if (!error) error = check_lg2(git_remote_ls(&heads, &count, connection), "failed to list remote refs", NULL);
+		for (size_t i = 0; !error && i < count; ++i) {
+			if (strcmp(heads[i]->name, ref_name) == 0) {
+				git_oid_cpy(id, &heads[i]->oid);
+				*found = true;
+				break;
+			}
+		}
+		git_remote_free(connection);
+		return error;
+	}
+
+	void plan_merge(git_repository* repo, const git_oid* local, const git_oid* remote, const git_oid* tracking, RepositoryPlan* plan) {
+		size_t ahead = 0, behind = 0;
+		if (git_oid_equal(local, remote)) {
+			plan->state = "up-to-date";
+			plan->action = "none";
+			return;
+		}
+
+		git_odb* odb = NULL;
+		bool known = git_repository_odb(&odb, repo) == 0 && git_odb_exists(odb, remote);
+		git_odb_free(odb);
+		if (known) {
+			git_graph_ahead_behind(&ahead, &behind, repo, local, remote);
+			plan->behind = (int)behind;
+		}
+		else {
+			// Not fetched yet, so the remote is behind by an unknown number of commits
+			if (tracking != NULL) git_graph_ahead_behind(&ahead, &behind, repo, local, tracking);
+			plan->behind = -1;
+		}
+		plan->ahead = (int)ahead;
+
+		if (plan->behind == 0) {
+			plan->state = "ahead";
+			plan->action = "none";
+		}
+		else if (ahead == 0) {
+			plan->state = "behind";
+			plan->action = "fast-forward";
+		}
+		else {
+			plan->state = "diverged";
+			plan->action = "merge";
+		}
+	}
 }
 
-void clone(git_repository** repo, const char* url, const char* path, const char* branch) {
-	git_clone_options options = GIT_CLONE_OPTIONS_INIT;
-	options.fetch_opts.callbacks.transfer_progress = transfer_progress;
-	options.fetch_opts.callbacks.credentials = get_credentials;
-	options.fetch_opts.callbacks.certificate_check = check_certificate;
-	options.checkout_branch = branch;
-	git_clone(repo, url, path, &options);
+int inspect(git_repository** repo, const char* path, RepositoryPlan* plan) {
+	git_reference* current_branch = NULL;
+	git_reference* upstream = NULL;
+	git_buf remote_name = { 0 };
+	git_remote* remote = NULL;
+
+	int error;
+	{
+		TraceSpan span("open", name);
+		error = check_lg2(git_repository_open_ext(repo, path, 0, NULL), "failed to open repo", NULL);
+	}
+	size_t changes = 0;
+	if (!error) error = count_changes(*repo, &changes);
+	plan->dirty = changes > 0;
+	if (!error) error = check_lg2(git_repository_head(&current_branch, *repo), "failed to lookup current branch", NULL);
+	if (!error) {
+		strcpy(plan->branch, git_reference_shorthand(current_branch));
+		error = check_lg2(git_branch_upstream(&upstream, current_branch), "failed to get upstream branch", NULL);
+	}
+	if (!error) error = check_lg2(git_branch_remote_name(&remote_name, *repo, git_reference_name(upstream)), "failed to get the reference's upstream", NULL);
+	if (!error) error = check_lg2(git_remote_lookup(&remote, *repo, remote_name.ptr), "failed to load remote", NULL);
+	git_buf_free(&remote_name);
+
+	git_oid remote_id;
+	bool found = false;
+	if (!error) error = advertised_id(remote, git_reference_name(upstream), &remote_id, &found);
+	if (!error && !found) error = report_error("the upstream branch does not exist on the remote");
+	if (!error) plan_merge(*repo, git_reference_target(current_branch), &remote_id, git_reference_target(upstream), plan);
+
+	if (error) strcpy(plan->error, last_error_message());
+	git_remote_free(remote);
+	git_reference_free(upstream);
+	git_reference_free(current_branch);
+	return error;
 }
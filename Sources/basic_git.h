@@ -1,6 +1,27 @@
 #pragma once
 
 struct git_repository;
+struct git_oid;
+struct RepositoryPlan;
 
-void pull(git_repository** repo, const char* path);
-void clone(git_repository** repo, const char* url, const char* path, const char* branch);
+// All operations return 0 or the libgit2 error code, the message is kept for the run summary.
+int check_lg2(int error, const char* message, const char* extra);
+int report_error(const char* message);
+const char* last_error_message();
+// Network errors which are worth a retry.
+bool last_error_is_transient();
+
+int pull(git_repository** repo, const char* path);
+// Fetches the branches of the remote the pull uses into refs/prefetch/<remote>/, leaves branches and the work tree alone.
+int prefetch(git_repository** repo, const char* path);
+// Clones in resumable steps, an interrupted clone continues where it stopped.
+int clone(git_repository** repo, const char* url, const char* path, const char* branch);
+bool clone_incomplete(const char* path);
+// Checks out another branch next to the primary repository, sharing its object database. Only fetches the new commits of that branch.
+int share(git_repository** repo, const char* primary_path, const char* url, const char* path, const char* branch);
+// Looks up the commit a remote branch ("HEAD" for the default branch) points to without fetching it.
+bool remote_head_id(git_oid* id, const char* url, const char* branch);
+// Creates or updates a bare repository with all branches and tags of url.
+int update_mirror(const char* url, const char* path);
+// Read-only: compares HEAD with the remote branch it tracks and checks the work tree.
+int inspect(git_repository** repo, const char* path, RepositoryPlan* plan);
@@ -0,0 +1,286 @@
+#include "constants.h"
+#include "blob_dedupe.h"
+#include "basic_git.h"
+#include "filesystem.h"
+#include "options.h"
+#include <git2.h>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace {
+	const int max_blob_files = 16 * 1024;
+	const int max_large_blobs = 16 * 1024;
+
+	// Where a blob was checked out, only trusted while size and modification time are unchanged.
+	struct BlobFile {
+		git_oid id;
+		long long size;
+		long long mtime;
+		char* path;
+	};
+
+	BlobFile* blob_files = 0;
+	int blob_file_count = 0;
+	std::mutex blob_files_mutex;
+
+	struct LargeBlob {
+		git_oid id;
+		git_filemode_t mode;
+		long long size;
+		char* path;
+	};
+
+	struct Walk {
+		git_repository* repo;
+		git_odb* odb;
+		LargeBlob* blobs;
+		int count;
+	};
+
+	void blob_files_path(char* path) {
+		join_path(path, data_dir, "blobs.txt");
+	}
+
+	BlobFile* find_blob_file(const git_oid* id) {
+		for (int i = 0; i < blob_file_count; ++i) {
+			if (git_oid_equal(&blob_files[i].id, id)) return &blob_files[i];
+		}
+		return 0;
+	}
+
+	bool unchanged(const char* path, long long size, long long mtime) {
+		struct stat st;
+		return stat(path, &st) == 0 && st.st_size == size && st.st_mtime == mtime;
+	}
+
+	void set_blob_file(BlobFile* file, const git_oid* id, const char* path, long long size, long long mtime) {
+		git_oid_cpy(&file->id, id);
+		file->size = size;
+		file->mtime = mtime;
+		delete[] file->path;
+		file->path = new char[strlen(path) + 1];
+		strcpy(file->path, path);
+	}
+
+	int collect_blob(const char* root, const git_tree_entry* entry, void* payload) {
+		Walk* walk = (Walk*)payload;
+		git_filemode_t mode = git_tree_entry_filemode(entry);
+		if (mode != GIT_FILEMODE_BLOB && mode != GIT_FILEMODE_BLOB_EXECUTABLE) return 0;
+		if (walk->count >= max_large_blobs) return 0;
+
+		size_t size;
+		git_otype type;
+		if (git_odb_read_header(&size, &type, walk->odb, git_tree_entry_id(entry)) != 0) {
+			giterr_clear();
+			return 0;
+		}
+		if ((long long)size < config.dedupe_min_size) return 0;
+
+		char* path = new char[strlen(root) + strlen(git_tree_entry_name(entry)) + 1];
+		strcpy(path, root);
+		strcat(path, git_tree_entry_name(entry));
+		// Line ending, ident and smudge filters make the checked out file differ from the blob,
+		// such files are neither shared nor remembered.
+		git_filter_list* filters = NULL;
+		if (git_filter_list_load(&filters, walk->repo, NULL, path, GIT_FILTER_TO_WORKTREE, GIT_FILTER_DEFAULT) != 0 || filters != NULL) {
+			giterr_clear();
+			git_filter_list_free(filters);
+			delete[] path;
+			return 0;
+		}
+
+		LargeBlob* blob = &walk->blobs[walk->count++];
+		git_oid_cpy(&blob->id, git_tree_entry_id(entry));
+		blob->mode = mode;
+		blob->size = (long long)size;
+		blob->path = path;
+		return 0;
+	}
+
+	void make_parent_dirs(char* path, size_t start) {
+		for (size_t i = start; path[i] != 0; ++i) {
+			if (path[i] == '/') {
+				path[i] = 0;
+				make_dir(path);
+				path[i] = '/';
+			}
+		}
+	}
+
+	void fill_entry(git_index_entry* entry, const LargeBlob* blob, const struct stat* st) {
+		memset(entry, 0, sizeof(*entry));
+		entry->ctime.seconds = (int32_t)st->st_ctime;
+		entry->mtime.seconds = (int32_t)st->st_mtime;
+#ifdef SYS_LINUX
+		entry->ctime.nanoseconds = (uint32_t)st->st_ctim.tv_nsec;
+		entry->mtime.nanoseconds = (uint32_t)st->st_mtim.tv_nsec;
+#endif
+		entry->dev = (uint32_t)st->st_dev;
+		entry->ino = (uint32_t)st->st_ino;
+		entry->mode = blob->mode;
+		entry->uid = (uint32_t)st->st_uid;
+		entry->gid = (uint32_t)st->st_gid;
+		entry->file_size = (uint32_t)st->st_size;
+		git_oid_cpy(&entry->id, &blob->id);
+		entry->path = blob->path;
+	}
+
+	// Reflinks the blob from an earlier checkout, false leaves it to the regular checkout.
+	bool share_blob(const char* workdir, LargeBlob* blob) {
+		char source[max_path_length];
+		long long size;
+		long long mtime;
+		{
+			std::lock_guard<std::mutex> lock(blob_files_mutex);
+			BlobFile* file = find_blob_file(&blob->id);
+			// The size is the blob's as well, so it was checked out without a filter
+			if (file == 0 || file->size != blob->size || strlen(file->path) >= max_path_length) return false;
+			strcpy(source, file->path);
+			size = file->size;
+			mtime = file->mtime;
+		}
+		if (!unchanged(source, size, mtime)) return false;
+
+		char path[max_path_length];
+		if (strlen(workdir) + strlen(blob->path) >= max_path_length) return false;
+		strcpy(path, workdir);
+		strcat(path, blob->path);
+		make_parent_dirs(path, strlen(workdir));
+		if (!reflink_file(source, path, blob->mode == GIT_FILEMODE_BLOB_EXECUTABLE)) return false;
+		// Size and mtime miss edits within the same second and tools which keep the mtime,
+		// reading the copy back still saves writing it
+		git_oid id;
+		if (!unchanged(source, size, mtime) || git_odb_hashfile(&id, path, GIT_OBJ_BLOB) != 0 || !git_oid_equal(&id, &blob->id)) {
+			giterr_clear();
+			remove(path);
+			return false;
+		}
+		return true;
+	}
+
+	// Shared files are added to the index so the checkout sees them as up to date and does not write them again.
+	int share_blobs(git_repository* repo, Walk* walk) {
+		const char* workdir = git_repository_workdir(repo);
+		git_index* index = NULL;
+		int error = check_lg2(git_repository_index(&index, repo), "failed to open index", NULL);
+		int shared = 0;
+		for (int i = 0; !error && i < walk->count; ++i) {
+			LargeBlob* blob = &walk->blobs[i];
+			if (!share_blob(workdir, blob)) continue;
+			char path[max_path_length];
+			strcpy(path, workdir);
+			strcat(path, blob->path);
+			struct stat st;
+			if (stat(path, &st) != 0) continue;
+			git_index_entry entry;
+			fill_entry(&entry, blob, &st);
+			error = check_lg2(git_index_add(index, &entry), "failed to add to index", blob->path);
+			++shared;
+		}
+		if (!error && shared > 0) error = check_lg2(git_index_write(index), "failed to write index", NULL);
+		git_index_free(index);
+		return error;
+	}
+
+	// Remembers the checked out files for later checkouts, replacing entries whose file has changed.
+	void register_blobs(git_repository* repo, Walk* walk) {
+		const char* workdir = git_repository_workdir(repo);
+		std::lock_guard<std::mutex> lock(blob_files_mutex);
+		if (blob_files == 0) return;
+		for (int i = 0; i < walk->count; ++i) {
+			LargeBlob* blob = &walk->blobs[i];
+			BlobFile* file = find_blob_file(&blob->id);
+			if (file != 0 && unchanged(file->path, file->size, file->mtime)) continue;
+			char path[max_path_length];
+			if (strlen(workdir) + strlen(blob->path) >= max_path_length) continue;
+			strcpy(path, workdir);
+			strcat(path, blob->path);
+			struct stat st;
+			if (stat(path, &st) != 0 || st.st_size != blob->size) continue;
+			if (file == 0) {
+				if (blob_file_count >= max_blob_files) continue;
+				file = &blob_files[blob_file_count++];
+				file->path = 0;
+			}
+			set_blob_file(file, &blob->id, path, st.st_size, st.st_mtime);
+		}
+	}
+}
+
+void load_blob_files() {
+	if (blob_files == 0) blob_files = new BlobFile[max_blob_files];
+	char path[max_path_length];
+	blob_files_path(path);
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return;
+	char line[max_path_length + 128];
+	while (blob_file_count < max_blob_files && fgets(line, sizeof(line), file) != NULL) {
+		char id[GIT_OID_HEXSZ + 1];
+		long long size;
+		long long mtime;
+		int offset;
+		if (sscanf(line, "%40s %lld %lld %n", id, &size, &mtime, &offset) != 3) continue;
+		char* blob_path = &line[offset];
+		blob_path[strcspn(blob_path, "\r\n")] = 0;
+		git_oid oid;
+		if (blob_path[0] == 0 || git_oid_fromstr(&oid, id) != 0) continue;
+		BlobFile* blob_file = &blob_files[blob_file_count++];
+		blob_file->path = 0;
+		set_blob_file(blob_file, &oid, blob_path, size, mtime);
+	}
+	fclose(file);
+}
+
+void save_blob_files() {
+	char path[max_path_length];
+	blob_files_path(path);
+	std::lock_guard<std::mutex> lock(blob_files_mutex);
+	if (blob_file_count == 0) return;
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return;
+	for (int i = 0; i < blob_file_count; ++i) {
+		BlobFile* blob_file = &blob_files[i];
+		char id[GIT_OID_HEXSZ + 1];
+		git_oid_tostr(id, sizeof(id), &blob_file->id);
+		fprintf(file, "%s %lld %lld %s\n", id, blob_file->size, blob_file->mtime, blob_file->path);
+	}
+	fclose(file);
+}
+
+int checkout_deduplicated(git_repository* repo, git_commit* commit) {
+	Walk walk;
+	walk.repo = repo;
+	walk.odb = NULL;
+	walk.blobs = 0;
+	walk.count = 0;
+
+	int error = 0;
+	if (config.dedupe_min_size > 0) {
+		git_tree* tree = NULL;
+		error = check_lg2(git_commit_tree(&tree, commit), "failed to lookup tree", NULL);
+		if (!error) error = check_lg2(git_repository_odb(&walk.odb, repo), "failed to open object database", NULL);
+		if (!error) {
+			walk.blobs = new LargeBlob[max_large_blobs];
+			error = check_lg2(git_tree_walk(tree, GIT_TREEWALK_PRE, collect_blob, &walk), "failed to walk tree", NULL);
+		}
+		if (!error) error = share_blobs(repo, &walk);
+		git_tree_free(tree);
+	}
+
+	if (!error) {
+		// The work tree only contains what an interrupted checkout of this clone left behind
+		git_checkout_options options = GIT_CHECKOUT_OPTIONS_INIT;
+		options.checkout_strategy = GIT_CHECKOUT_FORCE;
+		error = check_lg2(git_checkout_head(repo, &options), "Checkout failed.", NULL);
+	}
+	if (!error) register_blobs(repo, &walk);
+
+	for (int i = 0; i < walk.count; ++i) {
+		delete[] walk.blobs[i].path;
+	}
+	delete[] walk.blobs;
+	git_odb_free(walk.odb);
+	return error;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+struct git_repository;
+struct git_commit;
+
+// Kept in <data>/blobs.txt across runs.
+void load_blob_files();
+void save_blob_files();
+
+// Checks out commit into the work tree of a new clone. Blobs of at least config.dedupe_min_size
+// which were checked out before, in this or any other repository, become reflinks of that file.
+int checkout_deduplicated(git_repository* repo, git_commit* commit);
@@ -1,12 +1,17 @@
 #pragma once
 
-extern const char* name;
+// The repository the current thread is working on
+extern thread_local const char* name;
 extern const char* basePath;
+extern const char* data_dir;
 const int max_path_length = 4096;
 const int max_url_length = max_path_length;
 const int max_name_length = 256;
+const int max_children_length = 4096;
 
 int index_of(const char* str, char value);
 int last_index_of(const char* str, char value);
 bool starts_with(const char* string, const char* substring);
 bool ends_with(const char* string, const char* substring);
+void json_escape(char* to, const char* from);
+bool make_url(const char* repo_name, char* url);
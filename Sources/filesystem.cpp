@@ -0,0 +1,361 @@
+#include "constants.h"
+#include "filesystem.h"
+#include <stdio.h>
+#include <string.h>
+
+void join_path(char* path, const char* dir, const char* name) {
+	if (path != dir) strcpy(path, dir);
+	size_t length = strlen(path);
+	if (length > 0 && path[length - 1] != '/' && path[length - 1] != dir_sep) {
+		path[length] = dir_sep;
+		path[length + 1] = 0;
+	}
+	strcat(path, name);
+}
+
+namespace {
+	bool copy_file_contents(const char* from, const char* to) {
+		FILE* in = fopen(from, "rb");
+		if (in == NULL) return false;
+		FILE* out = fopen(to, "wb");
+		if (out == NULL) {
+			fclose(in);
+			return false;
+		}
+		char buffer[64 * 1024];
+		bool ok = true;
+		size_t length;
+		while ((length = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+			if (fwrite(buffer, 1, length, out) != length) {
+				ok = false;
+				break;
+			}
+		}
+		fclose(in);
+		if (fclose(out) != 0) ok = false;
+		return ok;
+	}
+
+	struct CopyTree {
+		const char* from;
+		const char* to;
+		bool in_git_dir;
+		bool link_objects;
+		bool ok;
+	};
+
+	bool copy_tree(const char* from, const char* to, bool in_git_dir, bool link_objects);
+
+	int copy_tree_entry(const char* name, bool dir, void* payload) {
+		CopyTree* copy = (CopyTree*)payload;
+		char from[max_path_length];
+		char to[max_path_length];
+		join_path(from, copy->from, name);
+		join_path(to, copy->to, name);
+		if (dir) {
+			bool link_objects = copy->link_objects || (copy->in_git_dir && strcmp(name, "objects") == 0);
+			copy->ok = copy_tree(from, to, strcmp(name, ".git") == 0, link_objects);
+		}
+		else if (copy->link_objects) {
+			copy->ok = link_file(from, to);
+		}
+		else {
+			copy->ok = copy_file(from, to);
+		}
+		return copy->ok ? 0 : 1;
+	}
+
+	bool copy_tree(const char* from, const char* to, bool in_git_dir, bool link_objects) {
+		if (!make_dir(to)) return false;
+		CopyTree copy;
+		copy.from = from;
+		copy.to = to;
+		copy.in_git_dir = in_git_dir;
+		copy.link_objects = link_objects;
+		copy.ok = true;
+		list_dir(from, copy_tree_entry, &copy);
+		return copy.ok;
+	}
+
+	struct RemoveTree {
+		const char* dir;
+		bool ok;
+	};
+
+	bool remove_file(const char* path);
+	bool remove_empty_dir(const char* dir);
+
+	int remove_tree_entry(const char* name, bool dir, void* payload) {
+		RemoveTree* remove = (RemoveTree*)payload;
+		char path[max_path_length];
+		join_path(path, remove->dir, name);
+		if (dir) {
+			if (!remove_tree(path)) remove->ok = false;
+		}
+		else if (!remove_file(path)) {
+			remove->ok = false;
+		}
+		return 0;
+	}
+
+	struct TreeSize {
+		const char* dir;
+		long long size;
+	};
+
+	long long file_size(const char* path);
+
+	int tree_size_entry(const char* name, bool dir, void* payload) {
+		TreeSize* size = (TreeSize*)payload;
+		char path[max_path_length];
+		join_path(path, size->dir, name);
+		if (dir) size->size += tree_size(path);
+		else size->size += file_size(path);
+		return 0;
+	}
+}
+
+bool copy_tree(const char* from, const char* to) {
+	return copy_tree(from, to, false, false);
+}
+
+bool remove_tree(const char* dir) {
+	RemoveTree remove;
+	remove.dir = dir;
+	remove.ok = true;
+	list_dir(dir, remove_tree_entry, &remove);
+	return remove_empty_dir(dir) && remove.ok;
+}
+
+long long tree_size(const char* dir) {
+	TreeSize size;
+	size.dir = dir;
+	size.size = 0;
+	list_dir(dir, tree_size_entry, &size);
+	return size.size;
+}
+
+#ifdef SYS_WINDOWS
+
+#include <Windows.h>
+
+bool is_dir(const char* dir) {
+	DWORD attribs = GetFileAttributesA(dir);
+	if (attribs == INVALID_FILE_ATTRIBUTES) return false;
+	return (attribs & FILE_ATTRIBUTE_DIRECTORY) != 0;
+}
+
+bool is_file(const char* path) {
+	DWORD attribs = GetFileAttributesA(path);
+	if (attribs == INVALID_FILE_ATTRIBUTES) return false;
+	return (attribs & FILE_ATTRIBUTE_DIRECTORY) == 0;
+}
+
+bool make_dir(const char* dir) {
+	return CreateDirectoryA(dir, NULL) != 0 || GetLastError() == ERROR_ALREADY_EXISTS;
+}
+
+int list_dir(const char* dir, dir_callback callback, void* payload) {
+	char pattern[max_path_length];
+	join_path(pattern, dir, "*");
+	WIN32_FIND_DATAA data;
+	HANDLE handle = FindFirstFileA(pattern, &data);
+	if (handle == INVALID_HANDLE_VALUE) return 0;
+	int result = 0;
+	do {
+		if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0) continue;
+		result = callback(data.cFileName, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0, payload);
+	} while (result == 0 && FindNextFileA(handle, &data));
+	FindClose(handle);
+	return result;
+}
+
+bool copy_file(const char* from, const char* to) {
+	return CopyFileA(from, to, FALSE) != 0;
+}
+
+bool link_file(const char* from, const char* to) {
+	if (CreateHardLinkA(to, from, NULL)) return true;
+	return copy_file(from, to);
+}
+
+bool reflink_file(const char* from, const char* to, bool executable) {
+	return false;
+}
+
+struct FileLock {
+	HANDLE file;
+};
+
+FileLock* lock_file(const char* path) {
+	// Opening without sharing is the lock, Windows releases it with the process
+	HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return 0;
+	FileLock* lock = new FileLock;
+	lock->file = file;
+	return lock;
+}
+
+void unlock_file(FileLock* lock) {
+	if (lock == 0) return;
+	CloseHandle(lock->file);
+	delete lock;
+}
+
+namespace {
+	bool remove_file(const char* path) {
+		SetFileAttributesA(path, FILE_ATTRIBUTE_NORMAL);
+		return DeleteFileA(path) != 0;
+	}
+
+	bool remove_empty_dir(const char* dir) {
+		return RemoveDirectoryA(dir) != 0;
+	}
+
+	long long file_size(const char* path) {
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return 0;
+		return ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	}
+}
+
+#else
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef SYS_LINUX
+#include <sys/ioctl.h>
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+bool is_dir(const char* dir) {
+	struct stat st;
+	return stat(dir, &st) == 0 && (st.st_mode & S_IFDIR) != 0;
+}
+
+bool is_file(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+bool make_dir(const char* dir) {
+	return mkdir(dir, 0755) == 0 || is_dir(dir);
+}
+
+int list_dir(const char* dir, dir_callback callback, void* payload) {
+	DIR* handle = opendir(dir);
+	if (handle == NULL) return 0;
+	int result = 0;
+	struct dirent* entry;
+	while (result == 0 && (entry = readdir(handle)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		char path[max_path_length];
+		join_path(path, dir, entry->d_name);
+		struct stat st;
+		if (lstat(path, &st) != 0) continue;
+		result = callback(entry->d_name, S_ISDIR(st.st_mode), payload);
+	}
+	closedir(handle);
+	return result;
+}
+
+bool copy_file(const char* from, const char* to) {
+	struct stat st;
+	if (lstat(from, &st) != 0) return false;
+	if (S_ISLNK(st.st_mode)) {
+		char target[max_path_length];
+		ssize_t length = readlink(from, target, sizeof(target) - 1);
+		if (length < 0) return false;
+		target[length] = 0;
+		unlink(to);
+		return symlink(target, to) == 0;
+	}
+#ifdef SYS_LINUX
+	int in = open(from, O_RDONLY);
+	if (in >= 0) {
+		int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+		if (out >= 0) {
+			bool cloned = ioctl(out, FICLONE, in) == 0;
+			close(out);
+			close(in);
+			if (cloned) return true;
+		}
+		else {
+			close(in);
+		}
+	}
+#endif
+	if (!copy_file_contents(from, to)) return false;
+	chmod(to, st.st_mode & 0777);
+	return true;
+}
+
+bool link_file(const char* from, const char* to) {
+	if (link(from, to) == 0) return true;
+	return copy_file(from, to);
+}
+
+bool reflink_file(const char* from, const char* to, bool executable) {
+#ifdef SYS_LINUX
+	int in = open(from, O_RDONLY);
+	if (in < 0) return false;
+	int out = open(to, O_WRONLY | O_CREAT | O_EXCL, executable ? 0755 : 0644);
+	if (out < 0) {
+		close(in);
+		return false;
+	}
+	bool cloned = ioctl(out, FICLONE, in) == 0;
+	close(out);
+	close(in);
+	if (!cloned) unlink(to);
+	return cloned;
+#else
+	return false;
+#endif
+}
+
+struct FileLock {
+	int file;
+};
+
+FileLock* lock_file(const char* path) {
+	int file = open(path, O_RDWR | O_CREAT, 0644);
+	if (file < 0) return 0;
+	if (flock(file, LOCK_EX | LOCK_NB) != 0) {
+		close(file);
+		return 0;
+	}
+	FileLock* lock = new FileLock;
+	lock->file = file;
+	return lock;
+}
+
+void unlock_file(FileLock* lock) {
+	if (lock == 0) return;
+	flock(lock->file, LOCK_UN);
+	close(lock->file);
+	delete lock;
+}
+
+namespace {
+	bool remove_file(const char* path) {
+		return unlink(path) == 0;
+	}
+
+	bool remove_empty_dir(const char* dir) {
+		return rmdir(dir) == 0;
+	}
+
+	long long file_size(const char* path) {
+		struct stat st;
+		if (lstat(path, &st) != 0) return 0;
+		return st.st_size;
+	}
+}
+
+#endif
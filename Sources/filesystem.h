@@ -0,0 +1,29 @@
+#pragma once
+
+extern const char dir_sep;
+
+struct FileLock;
+
+typedef int (*dir_callback)(const char* name, bool dir, void* payload);
+
+bool is_dir(const char* dir);
+bool is_file(const char* path);
+bool make_dir(const char* dir);
+void join_path(char* path, const char* dir, const char* name);
+
+// Calls callback for every entry of dir except "." and "..", stops when it returns non-zero.
+int list_dir(const char* dir, dir_callback callback, void* payload);
+
+// Shares the data blocks via a reflink where the filesystem supports it, copies otherwise.
+bool copy_file(const char* from, const char* to);
+// Hardlinks immutable files, falls back to copy_file.
+bool link_file(const char* from, const char* to);
+// Only succeeds when the data blocks can be shared, to must not exist yet.
+bool reflink_file(const char* from, const char* to, bool executable);
+// Copies a directory tree, hardlinking the contents of .git/objects.
+bool copy_tree(const char* from, const char* to);
+bool remove_tree(const char* dir);
+long long tree_size(const char* dir);
+// Exclusive between processes, 0 when another process holds it. Released when the process ends.
+FileLock* lock_file(const char* path);
+void unlock_file(FileLock* lock);
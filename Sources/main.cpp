@@ -1,14 +1,29 @@
 #include <git2.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "constants.h"
 #include "basic_git.h"
+#include "blob_dedupe.h"
+#include "memory_budget.h"
 #include "options.h"
-
-const char* name;
+#include "plan.h"
+#include "prefetch.h"
+#include "filesystem.h"
+#include "results.h"
+#include "scheduler.h"
+#include "server.h"
+#include "snapshot_cache.h"
+#include "timings.h"
+#include "trace.h"
+#include <chrono>
+#include <thread>
+
+thread_local const char* name;
 char baseUrl[max_url_length];
 Server* servers[max_servers + 1];
 const char* projects_dir;
+const char* data_dir;
 #ifdef SYS_WINDOWS
 const char dir_sep = '\\';
 #else
@@ -47,6 +62,17 @@ bool ends_with(const char* string, const char* substring) {
 	return true;
 }
 
+// to needs room for twice the length of from
+void json_escape(char* to, const char* from) {
+	int length = 0;
+	for (int i = 0; from[i] != 0; ++i) {
+		if ((unsigned char)from[i] < 0x20) continue;
+		if (from[i] == '"' || from[i] == '\\') to[length++] = '\\';
+		to[length++] = from[i];
+	}
+	to[length] = 0;
+}
+
 void extract_name(const char* url, char* name) {
 	int start = last_index_of(url, '/') + 1;
 	int end = strlen(url);
@@ -57,9 +83,45 @@ void extract_name(const char* url, char* name) {
 	name[end - start] = 0;
 }
 
-void pull_recursive(const char* repo_name, const char* path);
+Server* find_server(const char* repo_name);
+
+bool make_url(const char* repo_name, char* url) {
+	Server* server = find_server(repo_name);
+	if (server == 0) return false;
+	strcpy(url, server->base_url);
+	strcat(url, "/");
+	strcat(url, repo_name);
+	strcat(url, ".git");
+	return true;
+}
+
+bool is_repository(const char* path) {
+	char git_path[max_path_length];
+	join_path(git_path, path, ".git");
+	return is_dir(git_path) || is_file(git_path);
+}
 
-int pull_submodule(git_submodule* sub, const char* name_, void*) {
+Server* find_server(const char* repo_name) {
+	for (int i = max_servers; i >= 0; --i) {
+		if (servers[i] != 0 && servers[i]->has(repo_name)) return servers[i];
+	}
+	return 0;
+}
+
+void schedule_repository(const char* repo_name, const char* path, const char* branch, bool clone, const char* primary) {
+	Job* job = new Job;
+	strcpy(job->name, repo_name);
+	strcpy(job->path, path);
+	job->has_branch = branch != 0;
+	strcpy(job->branch, branch != 0 ? branch : "");
+	job->clone = clone;
+	strcpy(job->primary, primary != 0 ? primary : "");
+	job->server = find_server(repo_name);
+	schedule(job);
+}
+
+int schedule_submodule(git_submodule* sub, const char* name_, void* payload) {
+	Job* parent_job = (Job*)payload;
 	git_repository* parent = git_submodule_owner(sub);
 	char path[max_path_length];
 	strcpy(path, git_repository_workdir(parent));
@@ -68,18 +130,45 @@ int pull_submodule(git_submodule* sub, const char* name_, void*) {
 	char name[max_name_length];
 	extract_name(git_submodule_url(sub), name);
 
-	pull_recursive(name, path);
+	if (strlen(parent_job->children) + strlen(name) + 2 < max_children_length) {
+		if (parent_job->children[0] != 0) strcat(parent_job->children, ",");
+		strcat(parent_job->children, name);
+	}
+
+	// Submodules of a branch checkout share the objects of the same submodule in the primary checkout
+	char primary[max_path_length];
+	const char* sub_primary = 0;
+	if (parent_job->primary[0] != 0) {
+		join_path(primary, parent_job->primary, git_submodule_path(sub));
+		if (is_repository(primary) && !clone_incomplete(primary)) sub_primary = primary;
+	}
+
+	// Also clones submodules which failed to clone in a previous run
+	bool clone = parent_job->clone || !is_repository(path) || clone_incomplete(path);
+	schedule_repository(name, path, git_submodule_branch(sub), clone, sub_primary);
 
 	return 0;
 }
 
-void pull_recursive(const char* repo_name, const char* path) {
-	name = repo_name;
-
+git_repository* pull_repository(Job* job, bool* succeeded) {
 	git_repository* repo = NULL;
-	pull(&repo, path);
-	git_submodule_foreach(repo, pull_submodule, NULL);
-	git_repository_free(repo);
+	if (completed_in_previous_run(job->path)) {
+		add_result(job->name, job->path, Skipped, "completed in a previous run", 0);
+		check_lg2(git_repository_open(&repo, job->path), "failed to open repo", job->path);
+		return repo;
+	}
+
+	int attempts = 0;
+	int error;
+	do {
+		git_repository_free(repo);
+		repo = NULL;
+		error = pull(&repo, job->path);
+		++attempts;
+	} while (error && should_retry(attempts));
+	add_result(job->name, job->path, error ? Failed : Succeeded, error ? last_error_message() : 0, attempts);
+	*succeeded = !error;
+	return repo;
 }
 
 void add_remotes(git_repository* repo, const char* repo_name) {
@@ -91,102 +180,254 @@ void add_remotes(git_repository* repo, const char* repo_name) {
 			strcat(url, repo_name);
 			strcat(url, ".git");
 			git_remote* remote;
-			git_remote_create(&remote, repo, servers[i]->name, url);
+			if (git_remote_create(&remote, repo, servers[i]->name, url) == 0) git_remote_free(remote);
 		}
 	}
 }
 
-Server* find_server(const char* repo_name) {
-	for (int i = max_servers; i >= 0; --i) {
-		if (servers[i] != 0 && servers[i]->has(repo_name)) return servers[i];
+git_repository* clone_repository(Job* job, bool* succeeded) {
+	char url[max_url_length];
+	if (!make_url(job->name, url)) {
+		add_result(job->name, job->path, Failed, "no server provides this repository", 0);
+		return NULL;
 	}
-	return 0;
+
+	git_repository* repo = NULL;
+	int attempts = 0;
+	int error;
+	long long start = now_ms();
+	do {
+		if (job->primary[0] != 0) error = share(&repo, job->primary, url, job->path, job->has_branch ? job->branch : 0);
+		else error = clone(&repo, url, job->path, job->has_branch ? job->branch : 0);
+		++attempts;
+	} while (error && should_retry(attempts));
+
+	if (error) {
+		add_result(job->name, job->path, Failed, last_error_message(), attempts);
+		return NULL;
+	}
+	if (current_stats != 0) current_stats->clone_ms = now_ms() - start;
+	add_result(job->name, job->path, Succeeded, 0, attempts);
+	*succeeded = true;
+	add_remotes(repo, job->name);
+	return repo;
 }
 
-void clone_recursive(const char* repo_name, const char* path, const char* branch);
+// Updates one repository, its submodules become new jobs.
+void run_job(Job* job) {
+	name = job->name;
+	RepositoryStats stats;
+	current_stats = &stats;
+
+	git_repository* repo;
+	bool succeeded = false;
+	{
+		TraceSpan span(job->clone ? "clone" : "pull", job->name);
+		repo = job->clone ? clone_repository(job, &succeeded) : pull_repository(job, &succeeded);
+	}
+	if (repo != NULL) {
+		TraceSpan span("submodules", job->name);
+		git_submodule_foreach(repo, schedule_submodule, job);
+	}
+	git_repository_free(repo);
 
-int clone_submodule(git_submodule* sub, const char* name_, void*) {
-	git_repository* parent = git_submodule_owner(sub);
-	char path[max_path_length];
-	strcpy(path, git_repository_workdir(parent));
-	strcat(path, git_submodule_path(sub));
+	// Failed attempts say nothing about how long the repository takes, and a clone which shares
+	// the objects of a local checkout says nothing about cloning it over the network
+	bool shared = job->clone && job->primary[0] != 0;
+	if (succeeded && !shared && !completed_in_previous_run(job->path)) record_timings(job->name, &stats, job->children);
+	current_stats = 0;
+}
 
-	char name[max_name_length];
-	extract_name(git_submodule_url(sub), name);
-	
-	clone_recursive(name, path, git_submodule_branch(sub));
+// Other branches than master are checked out to <projects>/<name>@<branch> and share the objects of <projects>/<name>.
+bool checkout_path(const char* repo_name, const char* branch, char* path, char* primary, char* checkout_name) {
+	strcpy(path, projects_dir);
+	strcat(path, repo_name);
+	strcpy(checkout_name, repo_name);
+	if (strcmp(branch, "master") == 0) return false;
+
+	strcpy(primary, path);
+	strcat(checkout_name, "@");
+	strcat(checkout_name, branch);
+	for (int i = strlen(repo_name); checkout_name[i] != 0; ++i) {
+		if (checkout_name[i] == '/' || checkout_name[i] == '\\') checkout_name[i] = '-';
+	}
+	strcpy(path, projects_dir);
+	strcat(path, checkout_name);
+	return true;
+}
 
-	return 0;
+int update(const char* repo_name, const char* branch) {
+	char path[max_path_length];
+	char primary[max_path_length];
+	char checkout_name[max_name_length];
+	bool branch_checkout = checkout_path(repo_name, branch, path, primary, checkout_name);
+
+	lock_updates();
+	load_run_state(checkout_name);
+	load_timings();
+	load_blob_files();
+	if (branch_checkout && (!is_repository(primary) || clone_incomplete(primary))) {
+		schedule_repository(repo_name, primary, "master", true, 0);
+		run_jobs(run_job);
+	}
+
+	bool restored = false;
+	if (is_dir(path) && !clone_incomplete(path)) {
+		schedule_repository(repo_name, path, branch, false, branch_checkout ? primary : 0);
+	}
+	else if (!branch_checkout && !is_dir(path) && restore_snapshot(repo_name, path, branch)) {
+		add_result(repo_name, path, Succeeded, "restored from snapshot cache", 0);
+		restored = true;
+	}
+	else {
+		schedule_repository(repo_name, path, branch, true, branch_checkout ? primary : 0);
+	}
+	run_jobs(run_job);
+	save_timings();
+	save_blob_files();
+
+	int failures = print_summary();
+	save_run_state(checkout_name);
+	// Branch checkouts depend on the objects of the primary repository
+	if (failures == 0 && !restored && !branch_checkout) record_snapshot(path);
+	return failures;
 }
 
-void clone_recursive(const char* repo_name, const char* path, const char* branch) {
-	name = repo_name;
+// Inspects one repository without changing it, its submodules become new jobs.
+void plan_job(Job* job) {
+	name = job->name;
+	RepositoryPlan plan;
+	strcpy(plan.name, job->name);
+	strcpy(plan.path, job->path);
 
-	Server* server = find_server(repo_name);
+	git_repository* repo = NULL;
+	if (job->clone) {
+		strcpy(plan.branch, job->branch);
+		plan.state = "missing";
+		plan.action = "clone";
+	}
+	else {
+		TraceSpan span("plan", job->name);
+		inspect(&repo, job->path, &plan);
+	}
+	add_plan(&plan);
 
-	char url[max_url_length];
-	strcpy(url, server->base_url);
-	strcat(url, "/");
-	strcat(url, repo_name);
-	strcat(url, ".git");
+	if (repo != NULL) git_submodule_foreach(repo, schedule_submodule, job);
+	git_repository_free(repo);
+}
+
+int plan(const char* repo_name, const char* branch) {
+	char path[max_path_length];
+	char primary[max_path_length];
+	char checkout_name[max_name_length];
+	checkout_path(repo_name, branch, path, primary, checkout_name);
+
+	load_timings();
+	schedule_repository(repo_name, path, branch, !is_repository(path) || clone_incomplete(path), 0);
+	run_jobs(plan_job);
+	print_plan();
+	return 0;
+}
+
+// Prefetches one repository, its submodules become new jobs.
+void prefetch_job(Job* job) {
+	name = job->name;
+	// Nothing to prefetch into before the first update, an update which started meanwhile goes first
+	if (job->clone || !prefetch_idle()) return;
+	RepositoryStats stats;
+	current_stats = &stats;
 
 	git_repository* repo = NULL;
-	clone(&repo, url, path, branch);
-	add_remotes(repo, repo_name);
-	git_submodule_foreach(repo, clone_submodule, 0);
+	{
+		TraceSpan span("prefetch", job->name);
+		prefetch(&repo, job->path);
+	}
+	if (repo != NULL) git_submodule_foreach(repo, schedule_submodule, job);
 	git_repository_free(repo);
+	current_stats = 0;
 }
 
-bool is_dir(const char* dir);
+// Branch checkouts fetch into their own object database, they are prefetched like the primary repository.
+int schedule_branch_checkout(const char* entry, bool dir, void* payload) {
+	const char* repo_name = (const char*)payload;
+	size_t length = strlen(repo_name);
+	if (!dir || strncmp(entry, repo_name, length) != 0 || entry[length] != '@') return 0;
+	if (strlen(projects_dir) + strlen(entry) >= max_path_length) return 0;
+	char path[max_path_length];
+	strcpy(path, projects_dir);
+	strcat(path, entry);
+	if (is_repository(path) && !clone_incomplete(path)) schedule_repository(repo_name, path, 0, false, 0);
+	return 0;
+}
 
-void update(const char* repo_name) {
+int prefetch_loop(const char* repo_name) {
 	char path[max_path_length];
 	strcpy(path, projects_dir);
 	strcat(path, repo_name);
 
-	if (is_dir(path)) {
-		pull_recursive(repo_name, path);
-	}
-	else {
-		clone_recursive(repo_name, path, "master");
+	load_timings();
+	for (;;) {
+		if (prefetch_idle()) {
+			reset_bandwidth();
+			schedule_repository(repo_name, path, "master", !is_repository(path) || clone_incomplete(path), 0);
+			list_dir(projects_dir, schedule_branch_checkout, (void*)repo_name);
+			run_jobs(prefetch_job);
+		}
+		if (config.prefetch_interval <= 0) return 0;
+		std::this_thread::sleep_for(std::chrono::seconds(config.prefetch_interval));
 	}
 }
 
 int main(int argc, char** argv) {
 	const char* data_path = argv[1]; //"C:\\Users\\Robert\\AppData\\Local\\Kit\\"; 
 	projects_dir = argv[2]; //"C:\\Users\\Robert\\Projekte\\KitTest\\";
+	data_dir = data_path;
+	const char* branch = "master";
+	bool plan_only = false;
+	bool prefetch_only = false;
+	int port = 0;
+	// A server takes no repository argument
+	for (int i = 3; i < argc; ++i) {
+		if (starts_with(argv[i], "--trace=")) start_trace(&argv[i][strlen("--trace=")]);
+		else if (starts_with(argv[i], "--branch=")) branch = &argv[i][strlen("--branch=")];
+		else if (strcmp(argv[i], "--plan") == 0) plan_only = true;
+		else if (strcmp(argv[i], "--prefetch") == 0) prefetch_only = true;
+		else if (starts_with(argv[i], "--serve=")) port = atoi(&argv[i][strlen("--serve=")]);
+	}
 	
 	for (int i = 0; i < max_servers + 1; ++i) {
 		servers[i] = 0;
 	}
-	parse_options(data_path, servers);
+	{
+		TraceSpan span("parse_options", 0);
+		parse_options(data_path, servers);
+	}
 	for (int i = 0; servers[i] != 0; ++i) {
+		TraceSpan span("parse_server", servers[i]->name);
 		parse_server(data_path, servers[i]);
 	}
+	// The trace is written on exit, serving and repeated prefetching never get there
+	if (trace_enabled && (port != 0 || (prefetch_only && config.prefetch_interval > 0))) {
+		fprintf(stderr, "--trace is ignored with --serve and with --prefetch when prefetchInterval is set.\n");
+		trace_enabled = false;
+	}
 
 	git_libgit2_init();
-	update(argv[3]);
+#ifdef GIT_OPENSSL
+	// libgit2 leaves the locking callbacks which OpenSSL before 1.1 needs for threads to the application
+	if (git_openssl_set_locking() != 0) {
+		giterr_clear();
+		config.jobs = 1;
+	}
+#endif
+	apply_memory_budget();
+	int failures;
+	if (port != 0) failures = serve(port);
+	else if (prefetch_only) failures = prefetch_loop(argv[3]);
+	else failures = plan_only ? plan(argv[3], branch) : update(argv[3], branch);
 	//update("kraffiti");
 	git_libgit2_shutdown();
+	finish_trace();
+	return failures == 0 ? 0 : 1;
 }
 
-#ifdef SYS_WINDOWS
-
-#include <Windows.h>
-
-bool is_dir(const char* dir) {
-	DWORD attribs = GetFileAttributesA(dir);
-	if (attribs == INVALID_FILE_ATTRIBUTES) return false;
-	return (attribs & FILE_ATTRIBUTE_DIRECTORY) != 0;
-}
-
-#else
-
-#include <sys/stat.h>
-
-bool is_dir(const char* dir) {
-	struct stat st;
-	return stat(dir, &st) == 0 && (st.st_mode & S_IFDIR) != 0;
-}
-
-#endif
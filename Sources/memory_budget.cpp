@@ -0,0 +1,77 @@
+#include "constants.h"
+#include "memory_budget.h"
+#include "options.h"
+#include <git2.h>
+#include <stdio.h>
+
+namespace {
+	const long long megabyte = 1024 * 1024;
+	// Smallest share of the budget a job is started with
+	const long long min_job_memory = 64 * megabyte;
+	// libgit2's default on 64 bit systems
+	const long long max_window_size = 1024 * megabyte;
+}
+
+void apply_memory_budget() {
+	long long budget = config.memory_budget;
+	if (budget <= 0) return;
+
+	// Pack windows are mapped while objects are read and deltas resolved, the cache holds parsed objects,
+	// the rest is left to the jobs for index buffers, checkout and the transports.
+	long long mapped_limit = budget * 4 / 10;
+	long long cache_size = budget * 2 / 10;
+	long long job_memory = budget - mapped_limit - cache_size;
+
+	long long window_size = mapped_limit / 8;
+	if (window_size > max_window_size) window_size = max_window_size;
+	git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, (size_t)window_size);
+	git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, (size_t)mapped_limit);
+	git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)cache_size);
+
+	int jobs = (int)(job_memory / min_job_memory);
+	if (jobs < 1) jobs = 1;
+	if (jobs < config.jobs) config.jobs = jobs;
+	if (config.memory_limit <= 0 || config.memory_limit > job_memory) config.memory_limit = job_memory;
+
+	// On stderr, --plan prints JSON on stdout
+	fprintf(stderr, "Memory budget %lld MB: %lld MB pack windows, %lld MB object cache, %lld MB for %i jobs.\n",
+		budget / megabyte, mapped_limit / megabyte, cache_size / megabyte, job_memory / megabyte, config.jobs);
+}
+
+#ifdef SYS_WINDOWS
+
+#include <Windows.h>
+#include <Psapi.h>
+
+long long current_memory() {
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.WorkingSetSize;
+}
+
+#elif defined(SYS_OSX)
+
+#include <mach/mach.h>
+
+long long current_memory() {
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+	return info.resident_size;
+}
+
+#else
+
+#include <unistd.h>
+
+long long current_memory() {
+	FILE* file = fopen("/proc/self/statm", "rb");
+	if (file == NULL) return 0;
+	long long pages, resident;
+	int count = fscanf(file, "%lld %lld", &pages, &resident);
+	fclose(file);
+	if (count != 2) return 0;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+#endif
@@ -0,0 +1,8 @@
+#pragma once
+
+// Splits "memoryBudget" from options.json across libgit2's pack windows, its object cache
+// and the jobs the scheduler admits. Call after git_libgit2_init.
+void apply_memory_budget();
+
+// Resident memory of the whole process in bytes, 0 where unknown.
+long long current_memory();
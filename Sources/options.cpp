@@ -1,9 +1,12 @@
 #include "constants.h"
 #include "options.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "jsmn.h"
 
+Config config;
+
 void copy_string_token(char* to, jsmntok_t* from_token, char* from_string) {
 	int size = from_token->end - from_token->start;
 	for (int i = 0; i < size; ++i) {
@@ -16,6 +19,17 @@ int compare_string_token(char* value, jsmntok_t* token, char* string) {
 	return strncmp(value, &string[token->start], token->end - token->start);
 }
 
+long long number_token(jsmntok_t* token, char* string) {
+	char number[32];
+	int size = token->end - token->start;
+	if (size > 31) size = 31;
+	for (int i = 0; i < size; ++i) {
+		number[i] = string[token->start + i];
+	}
+	number[size] = 0;
+	return atoll(number);
+}
+
 Server* parseServer(jsmntok_t* tokens, int token_count, char* json_string, int& index) {
 	Server* server = new Server;
 	ServerType type = GitHub;
@@ -49,6 +63,20 @@ Server* parseServer(jsmntok_t* tokens, int token_count, char* json_string, int&
 				++index;
 				copy_string_token(server->pass, &tokens[index], json_string);
 			}
+			else if (compare_string_token("mirror", &tokens[index], json_string) == 0) {
+				++index;
+				copy_string_token(server->mirror, &tokens[index], json_string);
+				size_t length = strlen(server->mirror);
+				if (length > 0 && server->mirror[length - 1] == '/') server->mirror[length - 1] = 0;
+			}
+			else if (compare_string_token("mirrorUser", &tokens[index], json_string) == 0) {
+				++index;
+				copy_string_token(server->mirror_user, &tokens[index], json_string);
+			}
+			else if (compare_string_token("mirrorPass", &tokens[index], json_string) == 0) {
+				++index;
+				copy_string_token(server->mirror_pass, &tokens[index], json_string);
+			}
 			else if (compare_string_token("type", &tokens[index], json_string) == 0) {
 				++index;
 				if (compare_string_token("gitblit", &tokens[index], json_string) == 0) {
@@ -84,16 +112,30 @@ void parse_options(const char* data_path, Server** servers) {
 	strcpy(options_path, data_path);
 	strcat(options_path, "options.json");
 
-	char json_string[1024];
 	FILE* file;
 	file = fopen(options_path, "rb");
-	size_t length = fread(json_string, 1, 1024, file);
+	if (file == NULL) {
+		fprintf(stderr, "Could not open %s.\n", options_path);
+		return;
+	}
+	fseek(file, 0, SEEK_END);
+	long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char* json_string = new char[file_size + 1];
+	size_t length = fread(json_string, 1, file_size, file);
 	fclose(file);
 
 	jsmn_parser parser;
-	jsmntok_t tokens[100];
 	jsmn_init(&parser);
-	int token_count = jsmn_parse(&parser, json_string, length, tokens, 100);
+	int token_count = jsmn_parse(&parser, json_string, length, 0, 0);
+	if (token_count < 0) {
+		fprintf(stderr, "Could not parse %s (error %i).\n", options_path, token_count);
+		delete[] json_string;
+		return;
+	}
+	jsmntok_t* tokens = new jsmntok_t[token_count];
+	jsmn_init(&parser);
+	token_count = jsmn_parse(&parser, json_string, length, tokens, token_count);
 	for (int i = 0; i < token_count; ++i) {
 		if (tokens[i].type == JSMN_STRING && strncmp("servers", &json_string[tokens[i].start], tokens[i].end - tokens[i].start) == 0) {
 			++i;
@@ -103,12 +145,56 @@ void parse_options(const char* data_path, Server** servers) {
 			for (int i2 = 0; i2 < array_size; ++i2) {
 				int size = tokens[i].size;
 				++i;
-				servers[server_index] = parseServer(tokens, i + size * 2, json_string, i);
-				++server_index;
+				Server* server = parseServer(tokens, i + size * 2, json_string, i);
+				if (server_index < max_servers) servers[server_index++] = server;
+				else fprintf(stderr, "More than %i servers in %s, %s is ignored.\n", max_servers, options_path, server->name);
 			}
 			servers[server_index] = NULL;
+			--i;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("snapshotCacheSize", &tokens[i], json_string) == 0) {
+			++i;
+			config.snapshot_cache_size = number_token(&tokens[i], json_string) * 1024 * 1024;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("retries", &tokens[i], json_string) == 0) {
+			++i;
+			config.retries = (int)number_token(&tokens[i], json_string);
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("jobs", &tokens[i], json_string) == 0) {
+			++i;
+			config.jobs = (int)number_token(&tokens[i], json_string);
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("connectionsPerServer", &tokens[i], json_string) == 0) {
+			++i;
+			config.connections_per_server = (int)number_token(&tokens[i], json_string);
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("memoryLimit", &tokens[i], json_string) == 0) {
+			++i;
+			config.memory_limit = number_token(&tokens[i], json_string) * 1024 * 1024;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("memoryBudget", &tokens[i], json_string) == 0) {
+			++i;
+			config.memory_budget = number_token(&tokens[i], json_string) * 1024 * 1024;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("dedupeMinSize", &tokens[i], json_string) == 0) {
+			++i;
+			config.dedupe_min_size = number_token(&tokens[i], json_string) * 1024;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("prefetchInterval", &tokens[i], json_string) == 0) {
+			++i;
+			config.prefetch_interval = (int)number_token(&tokens[i], json_string);
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("prefetchBandwidth", &tokens[i], json_string) == 0) {
+			++i;
+			config.prefetch_bandwidth = number_token(&tokens[i], json_string) * 1024;
+		}
+		else if (tokens[i].type == JSMN_STRING && compare_string_token("prefetchMaxLoad", &tokens[i], json_string) == 0) {
+			++i;
+			config.prefetch_max_load = (int)number_token(&tokens[i], json_string);
 		}
 	}
+	delete[] tokens;
+	delete[] json_string;
 }
 
 void parse_server(const char* data_path, Server* server) {
@@ -13,6 +13,12 @@ struct Server {
 	char base_url[max_url_length];
 	char user[max_name_length];
 	char pass[max_name_length];
+	// A kitgit --serve instance which fetches go to instead of base_url, remotes keep base_url
+	char mirror[max_url_length];
+	// Sent to the mirror instead of user and pass, the mirror only speaks plain HTTP
+	// so this has to be a credential which is only used on the LAN
+	char mirror_user[max_name_length];
+	char mirror_pass[max_name_length];
 	char* repos[max_repos + 1];
 
 	Server() {
@@ -20,6 +26,9 @@ struct Server {
 		base_url[0] = 0;
 		user[0] = 0;
 		pass[0] = 0;
+		mirror[0] = 0;
+		mirror_user[0] = 0;
+		mirror_pass[0] = 0;
 		for (int i = 0; i < max_repos + 1; ++i) {
 			repos[i] = 0;
 		}
@@ -31,5 +40,38 @@ struct Server {
 const int max_servers = 32;
 extern Server* servers[max_servers + 1];
 
+struct Config {
+	long long snapshot_cache_size;
+	int retries;
+	int jobs;
+	int connections_per_server;
+	// Bytes the running jobs may take together, estimated from the packs they received in earlier runs, 0 is unlimited
+	long long memory_limit;
+	long long memory_budget;
+	// Smallest blob which is shared between work trees, 0 turns that off
+	long long dedupe_min_size;
+	// Seconds between prefetch passes, 0 runs one pass
+	int prefetch_interval;
+	// Bytes per second for all prefetching threads together, 0 is unlimited
+	long long prefetch_bandwidth;
+	// Percent of the processors, prefetching pauses above
+	int prefetch_max_load;
+
+	Config() {
+		snapshot_cache_size = 0;
+		retries = 3;
+		jobs = 4;
+		connections_per_server = 2;
+		memory_limit = 0;
+		memory_budget = 0;
+		dedupe_min_size = 0;
+		prefetch_interval = 0;
+		prefetch_bandwidth = 0;
+		prefetch_max_load = 50;
+	}
+};
+
+extern Config config;
+
 void parse_options(const char* data_path, Server** servers);
 void parse_server(const char* data_path, Server* server);
@@ -0,0 +1,47 @@
+#include "constants.h"
+#include "plan.h"
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+	const int max_plans = 1024;
+
+	RepositoryPlan* plans = 0;
+	int plan_count = 0;
+	std::mutex plans_mutex;
+}
+
+void add_plan(const RepositoryPlan* plan) {
+	std::lock_guard<std::mutex> lock(plans_mutex);
+	if (plans == 0) plans = new RepositoryPlan[max_plans];
+	if (plan_count >= max_plans) return;
+	plans[plan_count++] = *plan;
+}
+
+void print_plan() {
+	// Parents are planned before their submodules but in no fixed order otherwise
+	for (int i = 1; i < plan_count; ++i) {
+		for (int j = i; j > 0 && strcmp(plans[j - 1].path, plans[j].path) > 0; --j) {
+			RepositoryPlan plan = plans[j];
+			plans[j] = plans[j - 1];
+			plans[j - 1] = plan;
+		}
+	}
+
+	printf("[\n");
+	for (int i = 0; i < plan_count; ++i) {
+		RepositoryPlan* plan = &plans[i];
+		char name[max_name_length * 2];
+		char path[max_path_length * 2];
+		char branch[max_name_length * 2];
+		char error[sizeof(plan->error) * 2];
+		json_escape(name, plan->name);
+		json_escape(path, plan->path);
+		json_escape(branch, plan->branch);
+		json_escape(error, plan->error);
+		printf("{\"repository\":\"%s\",\"path\":\"%s\",\"branch\":\"%s\",\"state\":\"%s\",\"action\":\"%s\",\"dirty\":%s,\"ahead\":%i,\"behind\":%i,\"error\":\"%s\"}%s\n",
+			name, path, branch, plan->state, plan->action, plan->dirty ? "true" : "false", plan->ahead, plan->behind, error, i + 1 < plan_count ? "," : "");
+	}
+	printf("]\n");
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+// What an update would do to one repository, found without changing anything.
+struct RepositoryPlan {
+	char name[max_name_length];
+	char path[max_path_length];
+	char branch[max_name_length];
+	// "missing", "up-to-date", "behind", "ahead", "diverged" or "unknown"
+	const char* state;
+	// "clone", "none", "fast-forward" or "merge"
+	const char* action;
+	bool dirty;
+	int ahead;
+	// -1 when the remote has commits which were never fetched
+	int behind;
+	char error[1024];
+
+	RepositoryPlan() {
+		name[0] = 0;
+		path[0] = 0;
+		branch[0] = 0;
+		state = "unknown";
+		action = "none";
+		dirty = false;
+		ahead = 0;
+		behind = 0;
+		error[0] = 0;
+	}
+};
+
+void add_plan(const RepositoryPlan* plan);
+// Writes all plans as a JSON array to stdout.
+void print_plan();
@@ -0,0 +1,89 @@
+#include "constants.h"
+#include "prefetch.h"
+#include "filesystem.h"
+#include "options.h"
+#include "timings.h"
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+namespace {
+	FileLock* updates_lock = 0;
+	std::mutex probe_mutex;
+
+	long long pass_start = 0;
+	long long pass_bytes = 0;
+	std::mutex bandwidth_mutex;
+
+	void updates_lock_path(char* path) {
+		join_path(path, data_dir, "update.lock");
+	}
+
+	// Load average per processor, -1 when the system does not tell.
+	double system_load();
+}
+
+void lock_updates() {
+	char path[max_path_length];
+	updates_lock_path(path);
+	// Another update running at the same time is not waited for
+	if (updates_lock == 0) updates_lock = lock_file(path);
+}
+
+bool prefetch_idle() {
+	char path[max_path_length];
+	updates_lock_path(path);
+	{
+		// Locks on separate files conflict within the process as well, one prefetching thread
+		// probing must not look like an update to another one
+		std::lock_guard<std::mutex> lock(probe_mutex);
+		FileLock* file_lock = lock_file(path);
+		if (file_lock == 0) return false;
+		unlock_file(file_lock);
+	}
+
+	double load = system_load();
+	return config.prefetch_max_load <= 0 || load < 0 || load * 100 < config.prefetch_max_load;
+}
+
+void reset_bandwidth() {
+	std::lock_guard<std::mutex> lock(bandwidth_mutex);
+	pass_start = now_ms();
+	pass_bytes = 0;
+}
+
+void limit_bandwidth(long long received_bytes) {
+	if (config.prefetch_bandwidth <= 0) return;
+	long long due;
+	{
+		std::lock_guard<std::mutex> lock(bandwidth_mutex);
+		pass_bytes += received_bytes;
+		due = pass_start + pass_bytes * 1000 / config.prefetch_bandwidth;
+	}
+	// Not reading from the connection lets the sender slow down
+	long long wait = due - now_ms();
+	if (wait > 0) std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+}
+
+#ifdef SYS_WINDOWS
+
+namespace {
+	double system_load() {
+		return -1;
+	}
+}
+
+#else
+
+#include <stdlib.h>
+
+namespace {
+	double system_load() {
+		double load;
+		unsigned processors = std::thread::hardware_concurrency();
+		if (getloadavg(&load, 1) != 1) return -1;
+		return processors > 0 ? load / processors : load;
+	}
+}
+
+#endif
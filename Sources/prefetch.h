@@ -0,0 +1,10 @@
+#pragma once
+
+// Held by interactive updates for their whole run.
+void lock_updates();
+// No update is running and the load of the machine is below config.prefetch_max_load.
+bool prefetch_idle();
+// Starts a new prefetch pass for the bandwidth limit.
+void reset_bandwidth();
+// Waits while all prefetching threads together received more than config.prefetch_bandwidth allows.
+void limit_bandwidth(long long received_bytes);
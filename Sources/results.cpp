@@ -0,0 +1,145 @@
+#include "constants.h"
+#include "results.h"
+#include "basic_git.h"
+#include "filesystem.h"
+#include "options.h"
+#include "timings.h"
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+	const int max_results = 1024;
+	const int max_message_length = 1024;
+
+	struct Result {
+		char name[max_name_length];
+		char path[max_path_length];
+		ResultState state;
+		char message[max_message_length];
+		int attempts;
+		long long peak_memory;
+	};
+
+	Result* results = 0;
+	int result_count = 0;
+	std::mutex results_mutex;
+
+	char* completed[max_results];
+	int completed_count = 0;
+
+	void sleep_ms(int milliseconds);
+
+	void state_path(char* path, const char* repo_name) {
+		join_path(path, data_dir, repo_name);
+		strcat(path, ".state");
+	}
+}
+
+void add_result(const char* repo_name, const char* path, ResultState state, const char* message, int attempts) {
+	std::lock_guard<std::mutex> lock(results_mutex);
+	if (results == 0) results = new Result[max_results];
+	if (result_count >= max_results) return;
+	Result* result = &results[result_count++];
+	strcpy(result->name, repo_name);
+	strcpy(result->path, path);
+	result->state = state;
+	snprintf(result->message, max_message_length, "%s", message != 0 ? message : "");
+	result->attempts = attempts;
+	sample_memory();
+	result->peak_memory = current_stats != 0 ? current_stats->peak_memory : 0;
+}
+
+bool should_retry(int attempts) {
+	if (!last_error_is_transient() || attempts > config.retries) return false;
+	int delay = 1000;
+	for (int i = 1; i < attempts && delay < 30000; ++i) {
+		delay *= 2;
+	}
+	printf("#%s: Retrying in %i seconds.\n", name, delay / 1000);
+	sleep_ms(delay);
+	return true;
+}
+
+int print_summary() {
+	const char* state_names[] = { "ok", "failed", "skipped" };
+	int counts[3] = { 0, 0, 0 };
+	printf("\nSummary:\n");
+	for (int i = 0; i < result_count; ++i) {
+		Result* result = &results[i];
+		++counts[result->state];
+		if (result->attempts > 1) printf("%-8s %s (%s, %i attempts)", state_names[result->state], result->name, result->path, result->attempts);
+		else printf("%-8s %s (%s)", state_names[result->state], result->name, result->path);
+		if (result->peak_memory > 0) printf(", peak memory %lld MB", result->peak_memory / (1024 * 1024));
+		if (result->message[0] != 0) printf(": %s", result->message);
+		printf("\n");
+	}
+	printf("%i succeeded, %i failed, %i skipped.\n", counts[Succeeded], counts[Failed], counts[Skipped]);
+	return counts[Failed];
+}
+
+void load_run_state(const char* repo_name) {
+	char path[max_path_length];
+	state_path(path, repo_name);
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return;
+	char line[max_path_length];
+	while (completed_count < max_results && fgets(line, max_path_length, file) != NULL) {
+		size_t length = strlen(line);
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = 0;
+		if (length == 0) continue;
+		completed[completed_count] = new char[length + 1];
+		strcpy(completed[completed_count], line);
+		++completed_count;
+	}
+	fclose(file);
+}
+
+void save_run_state(const char* repo_name) {
+	char path[max_path_length];
+	state_path(path, repo_name);
+	bool failed = false;
+	for (int i = 0; i < result_count; ++i) {
+		if (results[i].state == Failed) failed = true;
+	}
+	if (!failed) {
+		remove(path);
+		return;
+	}
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return;
+	for (int i = 0; i < result_count; ++i) {
+		if (results[i].state != Failed) fprintf(file, "%s\n", results[i].path);
+	}
+	fclose(file);
+}
+
+bool completed_in_previous_run(const char* path) {
+	for (int i = 0; i < completed_count; ++i) {
+		if (strcmp(completed[i], path) == 0) return true;
+	}
+	return false;
+}
+
+#ifdef SYS_WINDOWS
+
+#include <Windows.h>
+
+namespace {
+	void sleep_ms(int milliseconds) {
+		Sleep(milliseconds);
+	}
+}
+
+#else
+
+#include <unistd.h>
+
+namespace {
+	void sleep_ms(int milliseconds) {
+		sleep(milliseconds / 1000);
+		usleep((milliseconds % 1000) * 1000);
+	}
+}
+
+#endif
@@ -0,0 +1,18 @@
+#pragma once
+
+enum ResultState {
+	Succeeded,
+	Failed,
+	Skipped
+};
+
+void add_result(const char* repo_name, const char* path, ResultState state, const char* message, int attempts);
+// Sleeps with exponential backoff and returns true when the last error is worth another attempt.
+bool should_retry(int attempts);
+// Prints what succeeded, failed or was skipped and returns the number of failures.
+int print_summary();
+
+// Repositories which succeeded in an incomplete run are skipped in the next one.
+void load_run_state(const char* repo_name);
+void save_run_state(const char* repo_name);
+bool completed_in_previous_run(const char* path);
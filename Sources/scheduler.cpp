@@ -0,0 +1,112 @@
+#include "constants.h"
+#include "scheduler.h"
+#include "options.h"
+#include "timings.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+
+namespace {
+	const int max_jobs = 4096;
+	const int max_threads = 64;
+
+	Job* pending[max_jobs];
+	int pending_count = 0;
+	int running = 0;
+	int server_connections[max_servers + 1];
+	long long memory_used = 0;
+	std::mutex jobs_mutex;
+	std::condition_variable jobs_changed;
+
+	int server_index(Server* server) {
+		for (int i = 0; servers[i] != 0; ++i) {
+			if (servers[i] == server) return i;
+		}
+		return -1;
+	}
+
+	bool admissible(Job* job) {
+		// Something has to run even when a single job exceeds the limits
+		if (running == 0) return true;
+		int server = server_index(job->server);
+		if (config.connections_per_server > 0 && server >= 0 && server_connections[server] >= config.connections_per_server) return false;
+		if (config.memory_limit > 0 && memory_used + job->memory > config.memory_limit) return false;
+		return true;
+	}
+
+	// Highest priority job that fits, -1 if there is none.
+	int next_job() {
+		int next = -1;
+		for (int i = 0; i < pending_count; ++i) {
+			if (!admissible(pending[i])) continue;
+			if (next < 0 || pending[i]->priority > pending[next]->priority) next = i;
+		}
+		return next;
+	}
+
+	void work(job_function function) {
+		std::unique_lock<std::mutex> lock(jobs_mutex);
+		for (;;) {
+			if (pending_count == 0 && running == 0) {
+				jobs_changed.notify_all();
+				return;
+			}
+			int index = next_job();
+			if (index < 0) {
+				jobs_changed.wait(lock);
+				continue;
+			}
+
+			Job* job = pending[index];
+			pending[index] = pending[--pending_count];
+			++running;
+			int server = server_index(job->server);
+			if (server >= 0) ++server_connections[server];
+			memory_used += job->memory;
+
+			lock.unlock();
+			function(job);
+			lock.lock();
+
+			--running;
+			if (server >= 0) --server_connections[server];
+			memory_used -= job->memory;
+			delete job;
+			jobs_changed.notify_all();
+		}
+	}
+}
+
+void schedule(Job* job) {
+	job->priority = estimated_duration(job->name, job->clone);
+	job->memory = estimated_memory(job->name);
+	job->children[0] = 0;
+
+	std::lock_guard<std::mutex> lock(jobs_mutex);
+	if (pending_count >= max_jobs) {
+		fprintf(stderr, "Too many repositories, skipping %s.\n", job->name);
+		delete job;
+		return;
+	}
+	pending[pending_count++] = job;
+	jobs_changed.notify_all();
+}
+
+void run_jobs(job_function function) {
+	for (int i = 0; i < max_servers + 1; ++i) {
+		server_connections[i] = 0;
+	}
+
+	int thread_count = config.jobs;
+	if (thread_count < 1) thread_count = 1;
+	if (thread_count > max_threads) thread_count = max_threads;
+	std::thread* threads[max_threads];
+	for (int i = 0; i < thread_count; ++i) {
+		threads[i] = new std::thread(work, function);
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		threads[i]->join();
+		delete threads[i];
+	}
+}
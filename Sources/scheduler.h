@@ -0,0 +1,26 @@
+#pragma once
+
+struct Server;
+
+struct Job {
+	char name[max_name_length];
+	char path[max_path_length];
+	char branch[max_name_length];
+	bool has_branch;
+	bool clone;
+	// Set for branch checkouts, the repository whose objects are shared
+	char primary[max_path_length];
+	Server* server;
+	// Comma separated submodule repositories, collected while the job runs
+	char children[max_children_length];
+
+	long long priority;
+	long long memory;
+};
+
+typedef void (*job_function)(Job* job);
+
+// Jobs can be added before and while run_jobs is working, parents add their submodules once they are done.
+void schedule(Job* job);
+// Runs longest critical path first on "jobs" threads, limited by "connectionsPerServer" and "memoryLimit".
+void run_jobs(job_function function);
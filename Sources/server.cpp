@@ -0,0 +1,701 @@
+#include "constants.h"
+#include "server.h"
+#include "basic_git.h"
+#include "filesystem.h"
+#include "options.h"
+#include "timings.h"
+#include <git2.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SYS_WINDOWS
+
+#include <winsock2.h>
+
+namespace {
+	typedef SOCKET socket_t;
+	const socket_t no_socket = INVALID_SOCKET;
+
+	bool start_sockets() {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}
+
+	void close_socket(socket_t socket) {
+		closesocket(socket);
+	}
+
+	void set_timeouts(socket_t socket, int seconds) {
+		DWORD timeout = seconds * 1000;
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+		setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+	}
+}
+
+#else
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+	typedef int socket_t;
+	const socket_t no_socket = -1;
+
+	bool start_sockets() {
+		// Clients which hang up are handled through the send errors
+		signal(SIGPIPE, SIG_IGN);
+		return true;
+	}
+
+	void close_socket(socket_t socket) {
+		close(socket);
+	}
+
+	void set_timeouts(socket_t socket, int seconds) {
+		struct timeval timeout;
+		timeout.tv_sec = seconds;
+		timeout.tv_usec = 0;
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	}
+}
+
+#endif
+
+namespace {
+	const int max_connections = 16;
+	// Clients which stop sending or receiving would otherwise hold one of the connections forever
+	const int socket_timeout = 60;
+	const int max_line_length = 16 * 1024;
+	// Wants and haves, a client gives up negotiating long before that
+	const int max_body_length = 1024 * 1024;
+	const int max_mirrors = 1024;
+	// Clients which update at the same time share one fetch from the server
+	const long long refresh_interval = 10000;
+	const char* capabilities = "multi_ack_detailed ofs-delta agent=kitgit";
+
+	struct Connection {
+		socket_t socket;
+		char buffer[64 * 1024];
+		int start;
+		int end;
+	};
+
+	struct Request {
+		char method[16];
+		char target[max_path_length];
+		char authorization[max_name_length * 3];
+		long long content_length;
+		bool chunked;
+		char* body;
+		int body_length;
+	};
+
+	// Chunked response body
+	struct Output {
+		Connection* connection;
+		char data[64 * 1024];
+		int length;
+		bool failed;
+	};
+
+	// Serializes the fetches of each mirror.
+	struct Mirror {
+		char path[max_path_length];
+		std::mutex* mutex;
+		long long last_fetch;
+	};
+
+	Mirror* mirrors = 0;
+	int mirror_count = 0;
+	std::mutex mirrors_mutex;
+
+	int connection_count = 0;
+	std::mutex connections_mutex;
+	std::condition_variable connections_changed;
+
+	bool send_all(Connection* connection, const char* data, int length) {
+		while (length > 0) {
+			int sent = send(connection->socket, data, length, 0);
+			if (sent <= 0) return false;
+			data += sent;
+			length -= sent;
+		}
+		return true;
+	}
+
+	bool fill(Connection* connection) {
+		if (connection->start > 0) {
+			memmove(connection->buffer, &connection->buffer[connection->start], connection->end - connection->start);
+			connection->end -= connection->start;
+			connection->start = 0;
+		}
+		if (connection->end >= (int)sizeof(connection->buffer)) return false;
+		int received = recv(connection->socket, &connection->buffer[connection->end], sizeof(connection->buffer) - connection->end, 0);
+		if (received <= 0) return false;
+		connection->end += received;
+		return true;
+	}
+
+	// Without the line break.
+	bool read_line(Connection* connection, char* line, int max_length) {
+		for (;;) {
+			for (int i = connection->start; i < connection->end; ++i) {
+				if (connection->buffer[i] != '\n') continue;
+				int length = i - connection->start;
+				if (length > 0 && connection->buffer[i - 1] == '\r') --length;
+				if (length >= max_length) return false;
+				memcpy(line, &connection->buffer[connection->start], length);
+				line[length] = 0;
+				connection->start = i + 1;
+				return true;
+			}
+			if (!fill(connection)) return false;
+		}
+	}
+
+	bool read_bytes(Connection* connection, char* data, int length) {
+		while (length > 0) {
+			if (connection->start == connection->end && !fill(connection)) return false;
+			int available = connection->end - connection->start;
+			int count = available < length ? available : length;
+			memcpy(data, &connection->buffer[connection->start], count);
+			connection->start += count;
+			data += count;
+			length -= count;
+		}
+		return true;
+	}
+
+	bool header_is(const char* line, const char* header) {
+		size_t length = strlen(header);
+		for (size_t i = 0; i < length; ++i) {
+			if (line[i] == 0 || tolower((unsigned char)line[i]) != tolower((unsigned char)header[i])) return false;
+		}
+		return line[length] == ':';
+	}
+
+	const char* header_value(const char* line) {
+		const char* value = strchr(line, ':') + 1;
+		while (*value == ' ') ++value;
+		return value;
+	}
+
+	bool read_body(Connection* connection, Request* request) {
+		request->body = new char[max_body_length];
+		request->body_length = 0;
+		if (!request->chunked) {
+			if (request->content_length > max_body_length) return false;
+			request->body_length = (int)request->content_length;
+			return read_bytes(connection, request->body, request->body_length);
+		}
+		char line[max_line_length];
+		for (;;) {
+			if (!read_line(connection, line, sizeof(line))) return false;
+			int size = (int)strtol(line, NULL, 16);
+			if (size == 0) break;
+			if (size < 0 || request->body_length + size > max_body_length) return false;
+			if (!read_bytes(connection, &request->body[request->body_length], size)) return false;
+			request->body_length += size;
+			if (!read_line(connection, line, sizeof(line))) return false;
+		}
+		// Trailers
+		do {
+			if (!read_line(connection, line, sizeof(line))) return false;
+		} while (line[0] != 0);
+		return true;
+	}
+
+	bool read_request(Connection* connection, Request* request) {
+		request->authorization[0] = 0;
+		request->content_length = 0;
+		request->chunked = false;
+		request->body = 0;
+		request->body_length = 0;
+
+		char line[max_line_length];
+		if (!read_line(connection, line, sizeof(line))) return false;
+		if (sscanf(line, "%15s %4095s", request->method, request->target) != 2) return false;
+		for (;;) {
+			if (!read_line(connection, line, sizeof(line))) return false;
+			if (line[0] == 0) break;
+			if (header_is(line, "Content-Length")) {
+				request->content_length = atoll(header_value(line));
+			}
+			else if (header_is(line, "Transfer-Encoding")) {
+				request->chunked = strstr(header_value(line), "chunked") != 0;
+			}
+			else if (header_is(line, "Content-Encoding")) {
+				// Only kitgit clients are served, libgit2 does not compress requests
+				if (strcmp(header_value(line), "identity") != 0) return false;
+			}
+			else if (header_is(line, "Authorization")) {
+				if (strlen(header_value(line)) >= sizeof(request->authorization)) return false;
+				strcpy(request->authorization, header_value(line));
+			}
+		}
+		if (strcmp(request->method, "POST") == 0) return read_body(connection, request);
+		return true;
+	}
+
+	void send_status(Connection* connection, const char* status) {
+		char response[256];
+		sprintf(response, "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n%s\r\n", status,
+			strncmp(status, "401", 3) == 0 ? "WWW-Authenticate: Basic realm=\"kitgit\"\r\n" : "");
+		send_all(connection, response, strlen(response));
+	}
+
+	void start_output(Output* out, Connection* connection, const char* content_type) {
+		out->connection = connection;
+		out->length = 0;
+		char response[256];
+		sprintf(response, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nCache-Control: no-cache\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n", content_type);
+		out->failed = !send_all(connection, response, strlen(response));
+	}
+
+	void flush_output(Output* out) {
+		if (out->failed || out->length == 0) return;
+		char size[16];
+		sprintf(size, "%x\r\n", out->length);
+		out->failed = !send_all(out->connection, size, strlen(size)) || !send_all(out->connection, out->data, out->length) || !send_all(out->connection, "\r\n", 2);
+		out->length = 0;
+	}
+
+	void write_output(Output* out, const char* data, size_t length) {
+		while (length > 0 && !out->failed) {
+			size_t count = sizeof(out->data) - out->length;
+			if (count > length) count = length;
+			memcpy(&out->data[out->length], data, count);
+			out->length += (int)count;
+			data += count;
+			length -= count;
+			if (out->length == (int)sizeof(out->data)) flush_output(out);
+		}
+	}
+
+	void finish_output(Output* out) {
+		flush_output(out);
+		if (!out->failed) out->failed = !send_all(out->connection, "0\r\n\r\n", 5);
+	}
+
+	void write_pkt(Output* out, const char* data, size_t length) {
+		char prefix[5];
+		sprintf(prefix, "%04x", (unsigned)length + 4);
+		write_output(out, prefix, 4);
+		write_output(out, data, length);
+	}
+
+	void write_pkt(Output* out, const char* line) {
+		write_pkt(out, line, strlen(line));
+	}
+
+	void write_flush(Output* out) {
+		write_output(out, "0000", 4);
+	}
+
+	void base64(char* to, const char* from) {
+		const char* digits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		size_t length = strlen(from);
+		int out = 0;
+		for (size_t i = 0; i < length; i += 3) {
+			unsigned value = (unsigned char)from[i] << 16;
+			if (i + 1 < length) value |= (unsigned char)from[i + 1] << 8;
+			if (i + 2 < length) value |= (unsigned char)from[i + 2];
+			to[out++] = digits[(value >> 18) & 63];
+			to[out++] = digits[(value >> 12) & 63];
+			to[out++] = i + 1 < length ? digits[(value >> 6) & 63] : '=';
+			to[out++] = i + 2 < length ? digits[value & 63] : '=';
+		}
+		to[out] = 0;
+	}
+
+	// The same credentials which the server itself wants are expected.
+	// Repositories which need credentials on the server are only served with the mirror's own credentials,
+	// clients must not send the server's over plain HTTP.
+	bool authorized(Server* server, const Request* request) {
+		if (server->user[0] == 0) return true;
+		if (server->mirror_user[0] == 0) return false;
+		char credentials[max_name_length * 2 + 1];
+		strcpy(credentials, server->mirror_user);
+		strcat(credentials, ":");
+		strcat(credentials, server->mirror_pass);
+		char expected[max_name_length * 3];
+		strcpy(expected, "Basic ");
+		base64(&expected[strlen(expected)], credentials);
+		return strcmp(request->authorization, expected) == 0;
+	}
+
+	Mirror* find_mirror(const char* path) {
+		std::lock_guard<std::mutex> lock(mirrors_mutex);
+		if (mirrors == 0) mirrors = new Mirror[max_mirrors];
+		for (int i = 0; i < mirror_count; ++i) {
+			if (strcmp(mirrors[i].path, path) == 0) return &mirrors[i];
+		}
+		if (mirror_count >= max_mirrors) return 0;
+		Mirror* mirror = &mirrors[mirror_count++];
+		strcpy(mirror->path, path);
+		mirror->mutex = new std::mutex;
+		mirror->last_fetch = 0;
+		return mirror;
+	}
+
+	// Creates the mirror on a miss and refreshes it at most every refresh_interval,
+	// an existing mirror is still served when the server can not be reached.
+	bool prepare_mirror(Server* server, const char* repo_name, const char* path, bool refresh) {
+		Mirror* mirror = find_mirror(path);
+		if (mirror == 0) return is_dir(path);
+		std::lock_guard<std::mutex> lock(*mirror->mutex);
+		bool exists = is_dir(path);
+		if (exists && (!refresh || (mirror->last_fetch != 0 && now_ms() - mirror->last_fetch < refresh_interval))) return true;
+
+		char url[max_url_length];
+		strcpy(url, server->base_url);
+		strcat(url, "/");
+		strcat(url, repo_name);
+		strcat(url, ".git");
+		int error = update_mirror(url, path);
+		if (!error) {
+			mirror->last_fetch = now_ms();
+			return true;
+		}
+		if (!exists) remove_tree(path);
+		return exists;
+	}
+
+	struct Advertisement {
+		git_repository* repo;
+		Output* out;
+		bool first;
+		char capabilities[max_name_length * 2];
+	};
+
+	void advertise(Advertisement* advertisement, const git_oid* id, const char* ref_name) {
+		char line[GIT_OID_HEXSZ + max_name_length * 5];
+		git_oid_fmt(line, id);
+		line[GIT_OID_HEXSZ] = ' ';
+		strcpy(&line[GIT_OID_HEXSZ + 1], ref_name);
+		size_t length = strlen(line);
+		if (advertisement->first) {
+			// The capabilities follow the first ref after a NUL
+			strcpy(&line[length + 1], advertisement->capabilities);
+			length += 1 + strlen(advertisement->capabilities);
+			advertisement->first = false;
+		}
+		line[length++] = '\n';
+		write_pkt(advertisement->out, line, length);
+	}
+
+	int advertise_ref(const char* ref_name, void* payload) {
+		Advertisement* advertisement = (Advertisement*)payload;
+		if (!starts_with(ref_name, "refs/heads/") && !starts_with(ref_name, "refs/tags/")) return 0;
+		if (strlen(ref_name) + 3 >= max_name_length * 2) return 0;
+		git_oid id;
+		if (git_reference_name_to_id(&id, advertisement->repo, ref_name) != 0) {
+			giterr_clear();
+			return 0;
+		}
+		advertise(advertisement, &id, ref_name);
+
+		// Annotated tags also announce the commit they point to
+		git_object* object = NULL;
+		git_object* peeled = NULL;
+		if (git_object_lookup(&object, advertisement->repo, &id, GIT_OBJ_TAG) == 0 && git_tag_peel(&peeled, (git_tag*)object) == 0) {
+			char peeled_name[max_name_length * 2];
+			strcpy(peeled_name, ref_name);
+			strcat(peeled_name, "^{}");
+			advertise(advertisement, git_object_id(peeled), peeled_name);
+		}
+		giterr_clear();
+		git_object_free(peeled);
+		git_object_free(object);
+		return 0;
+	}
+
+	void send_refs(Connection* connection, git_repository* repo) {
+		Output* out = new Output;
+		start_output(out, connection, "application/x-git-upload-pack-advertisement");
+		write_pkt(out, "# service=git-upload-pack\n");
+		write_flush(out);
+
+		Advertisement advertisement;
+		advertisement.repo = repo;
+		advertisement.out = out;
+		advertisement.first = true;
+		strcpy(advertisement.capabilities, capabilities);
+		git_reference* head = NULL;
+		if (git_reference_lookup(&head, repo, "HEAD") == 0 && git_reference_type(head) == GIT_REF_SYMBOLIC
+			&& strlen(git_reference_symbolic_target(head)) < max_name_length) {
+			strcat(advertisement.capabilities, " symref=HEAD:");
+			strcat(advertisement.capabilities, git_reference_symbolic_target(head));
+		}
+		git_reference_free(head);
+		giterr_clear();
+
+		git_oid id;
+		if (git_reference_name_to_id(&id, repo, "HEAD") == 0) advertise(&advertisement, &id, "HEAD");
+		giterr_clear();
+		git_reference_foreach_name(repo, advertise_ref, &advertisement);
+		if (advertisement.first) {
+			git_oid zero;
+			memset(&zero, 0, sizeof(zero));
+			advertise(&advertisement, &zero, "capabilities^{}");
+		}
+		write_flush(out);
+		finish_output(out);
+		delete out;
+	}
+
+	int write_pack(void* data, size_t size, void* payload) {
+		Output* out = (Output*)payload;
+		write_output(out, (const char*)data, size);
+		return out->failed ? -1 : 0;
+	}
+
+	// Everything reachable from the wants which the client does not have through the common commits.
+	int send_pack(Output* out, git_repository* repo, const git_oid* wants, int want_count, const git_oid* common, int common_count) {
+		git_packbuilder* packbuilder = NULL;
+		git_revwalk* walk = NULL;
+		int error = check_lg2(git_packbuilder_new(&packbuilder, repo), "failed to create packbuilder", NULL);
+		if (!error) error = check_lg2(git_revwalk_new(&walk, repo), "failed to create revwalk", NULL);
+		for (int i = 0; !error && i < want_count; ++i) {
+			git_object* object = NULL;
+			git_object* commit = NULL;
+			error = check_lg2(git_object_lookup(&object, repo, &wants[i], GIT_OBJ_ANY), "failed to find wanted object", NULL);
+			if (!error && git_object_type(object) == GIT_OBJ_TAG) {
+				error = check_lg2(git_packbuilder_insert(packbuilder, &wants[i], NULL), "failed to add tag", NULL);
+			}
+			if (!error) {
+				if (git_object_peel(&commit, object, GIT_OBJ_COMMIT) == 0) {
+					error = check_lg2(git_revwalk_push(walk, git_object_id(commit)), "failed to add commit", NULL);
+				}
+				else {
+					giterr_clear();
+					error = check_lg2(git_packbuilder_insert_recur(packbuilder, &wants[i], NULL), "failed to add object", NULL);
+				}
+			}
+			git_object_free(commit);
+			git_object_free(object);
+		}
+		for (int i = 0; !error && i < common_count; ++i) {
+			if (git_revwalk_hide(walk, &common[i]) != 0) giterr_clear();
+		}
+		if (!error) error = check_lg2(git_packbuilder_insert_walk(packbuilder, walk), "failed to collect objects", NULL);
+		if (!error) {
+			printf("#%s: Sending %u objects.\n", name, git_packbuilder_object_count(packbuilder));
+			error = check_lg2(git_packbuilder_foreach(packbuilder, write_pack, out), "failed to send pack", NULL);
+		}
+		git_revwalk_free(walk);
+		git_packbuilder_free(packbuilder);
+		return error;
+	}
+
+	bool parse_oid(git_oid* id, const char* line, size_t length, const char* prefix) {
+		size_t prefix_length = strlen(prefix);
+		if (length < prefix_length + GIT_OID_HEXSZ || strncmp(line, prefix, prefix_length) != 0) return false;
+		return git_oid_fromstrn(id, &line[prefix_length], GIT_OID_HEXSZ) == 0;
+	}
+
+	// Stateless negotiation, every request repeats the wants and the common commits found so far.
+	void upload_pack(Connection* connection, git_repository* repo, const Request* request) {
+		int max_lines = request->body_length / 4 + 1;
+		git_oid* wants = new git_oid[max_lines];
+		git_oid* haves = new git_oid[max_lines];
+		int want_count = 0;
+		int have_count = 0;
+		bool done = false;
+		const char* unsupported = 0;
+
+		for (int position = 0; position + 4 <= request->body_length;) {
+			char hex[5];
+			memcpy(hex, &request->body[position], 4);
+			hex[4] = 0;
+			int length = (int)strtol(hex, NULL, 16);
+			if (length == 0) {
+				position += 4;
+				continue;
+			}
+			if (length < 4 || position + length > request->body_length) break;
+			const char* line = &request->body[position + 4];
+			size_t line_length = length - 4;
+			position += length;
+
+			if (parse_oid(&wants[want_count], line, line_length, "want ")) ++want_count;
+			else if (parse_oid(&haves[have_count], line, line_length, "have ")) ++have_count;
+			else if (line_length >= 4 && strncmp(line, "done", 4) == 0) done = true;
+			else if (line_length >= 7 && (strncmp(line, "shallow", 7) == 0 || strncmp(line, "deepen", 6) == 0)) unsupported = "ERR shallow fetches are not supported";
+		}
+
+		git_odb* odb = NULL;
+		int common_count = 0;
+		if (check_lg2(git_repository_odb(&odb, repo), "failed to open object database", NULL) == 0) {
+			for (int i = 0; i < have_count; ++i) {
+				if (git_odb_exists(odb, &haves[i])) haves[common_count++] = haves[i];
+			}
+			git_odb_free(odb);
+		}
+
+		Output* out = new Output;
+		start_output(out, connection, "application/x-git-upload-pack-result");
+		char line[GIT_OID_HEXSZ + 32];
+		char id[GIT_OID_HEXSZ + 1];
+		if (unsupported != 0 || want_count == 0) {
+			write_pkt(out, unsupported != 0 ? unsupported : "ERR no wants");
+		}
+		else if (!done) {
+			for (int i = 0; i < common_count; ++i) {
+				git_oid_tostr(id, sizeof(id), &haves[i]);
+				sprintf(line, "ACK %s common\n", id);
+				write_pkt(out, line);
+			}
+			write_pkt(out, "NAK\n");
+		}
+		else {
+			if (common_count > 0) {
+				git_oid_tostr(id, sizeof(id), &haves[common_count - 1]);
+				sprintf(line, "ACK %s\n", id);
+				write_pkt(out, line);
+			}
+			else {
+				write_pkt(out, "NAK\n");
+			}
+			send_pack(out, repo, wants, want_count, haves, common_count);
+		}
+		finish_output(out);
+
+		delete out;
+		delete[] haves;
+		delete[] wants;
+	}
+
+	// Splits /<server>/<repository>.git/<service> and checks that the server provides the repository.
+	Server* parse_target(const char* target, char* repo_name, const char** service) {
+		if (target[0] != '/' || strstr(target, "..") != 0 || strchr(target, '\\') != 0) return 0;
+		const char* server_end = strchr(&target[1], '/');
+		const char* repo_end = strstr(target, ".git/");
+		if (server_end == 0 || repo_end == 0 || repo_end <= server_end + 1) return 0;
+		size_t server_length = server_end - &target[1];
+		size_t repo_length = repo_end - (server_end + 1);
+		if (server_length >= max_name_length || repo_length >= max_name_length) return 0;
+		strncpy(repo_name, server_end + 1, repo_length);
+		repo_name[repo_length] = 0;
+		*service = repo_end + 4;
+
+		for (int i = 0; servers[i] != 0; ++i) {
+			if (strlen(servers[i]->name) == server_length && strncmp(servers[i]->name, &target[1], server_length) == 0) {
+				return servers[i]->has(repo_name) ? servers[i] : 0;
+			}
+		}
+		return 0;
+	}
+
+	void handle_request(Connection* connection) {
+		Request request;
+		if (!read_request(connection, &request)) {
+			send_status(connection, "400 Bad Request");
+			delete[] request.body;
+			return;
+		}
+
+		char repo_name[max_name_length];
+		repo_name[0] = 0;
+		const char* service = "";
+		Server* server = parse_target(request.target, repo_name, &service);
+		name = repo_name;
+		bool refs = strcmp(request.method, "GET") == 0 && strcmp(service, "/info/refs?service=git-upload-pack") == 0;
+		bool pack = strcmp(request.method, "POST") == 0 && strcmp(service, "/git-upload-pack") == 0;
+		char path[max_path_length];
+		if (server == 0) {
+			send_status(connection, "404 Not Found");
+		}
+		else if (!refs && !pack) {
+			// Pushes go to the server itself
+			send_status(connection, "403 Forbidden");
+		}
+		else if (!authorized(server, &request)) {
+			send_status(connection, "401 Unauthorized");
+		}
+		else {
+			join_path(path, data_dir, "mirror");
+			make_dir(path);
+			join_path(path, path, server->name);
+			make_dir(path);
+			join_path(path, path, repo_name);
+			strcat(path, ".git");
+
+			git_repository* repo = NULL;
+			if (!prepare_mirror(server, repo_name, path, refs)) {
+				send_status(connection, "502 Bad Gateway");
+			}
+			else if (check_lg2(git_repository_open(&repo, path), "failed to open mirror", path) != 0) {
+				send_status(connection, "500 Internal Server Error");
+			}
+			else if (refs) {
+				send_refs(connection, repo);
+			}
+			else {
+				upload_pack(connection, repo, &request);
+			}
+			git_repository_free(repo);
+		}
+		delete[] request.body;
+		name = 0;
+	}
+
+	void handle_connection(socket_t socket) {
+		Connection* connection = new Connection;
+		connection->socket = socket;
+		connection->start = 0;
+		connection->end = 0;
+		handle_request(connection);
+		close_socket(socket);
+		delete connection;
+
+		std::lock_guard<std::mutex> lock(connections_mutex);
+		--connection_count;
+		connections_changed.notify_one();
+	}
+}
+
+int serve(int port) {
+	if (!start_sockets()) {
+		fprintf(stderr, "Could not initialize sockets.\n");
+		return 1;
+	}
+	socket_t server_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (server_socket == no_socket) {
+		fprintf(stderr, "Could not create socket.\n");
+		return 1;
+	}
+	int reuse = 1;
+	setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons((unsigned short)port);
+	if (bind(server_socket, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server_socket, 64) != 0) {
+		fprintf(stderr, "Could not listen on port %i.\n", port);
+		close_socket(server_socket);
+		return 1;
+	}
+	printf("Serving on port %i.\n", port);
+
+	for (;;) {
+		socket_t client = accept(server_socket, NULL, NULL);
+		if (client == no_socket) continue;
+		set_timeouts(client, socket_timeout);
+		std::unique_lock<std::mutex> lock(connections_mutex);
+		while (connection_count >= max_connections) connections_changed.wait(lock);
+		++connection_count;
+		lock.unlock();
+		std::thread(handle_connection, client).detach();
+	}
+}
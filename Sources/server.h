@@ -0,0 +1,7 @@
+#pragma once
+
+// Serves the repositories of all configured servers to other kitgit instances over the git smart HTTP protocol.
+// Requests go to /<server name>/<repository>.git, the repositories are mirrored below <data>/mirror
+// and fetched from the server when a client asks for their refs. Servers with a user are only served to clients
+// which send the server's mirrorUser and mirrorPass from options.json. Only returns when the port can not be opened.
+int serve(int port);
@@ -0,0 +1,302 @@
+#include "constants.h"
+#include "snapshot_cache.h"
+#include "basic_git.h"
+#include "filesystem.h"
+#include "options.h"
+#include <git2.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+namespace {
+	const int max_manifest_length = 64 * 1024;
+	const int max_snapshots = 256;
+
+	// One line per repository: "<commit> <branch> <url> <path relative to the workspace>".
+	struct Manifest {
+		char* text;
+		int length;
+		bool valid;
+	};
+
+	void snapshots_dir(char* dir) {
+		join_path(dir, data_dir, "snapshots");
+	}
+
+	int read_file(const char* path, char* data, int max_length) {
+		FILE* file = fopen(path, "rb");
+		if (file == NULL) return -1;
+		int length = (int)fread(data, 1, max_length - 1, file);
+		fclose(file);
+		data[length] = 0;
+		return length;
+	}
+
+	bool write_file(const char* path, const char* data, int length) {
+		FILE* file = fopen(path, "wb");
+		if (file == NULL) return false;
+		bool ok = (int)fwrite(data, 1, length, file) == length;
+		if (fclose(file) != 0) ok = false;
+		return ok;
+	}
+
+	void write_info(const char* entry, long long size) {
+		char path[max_path_length];
+		join_path(path, entry, "info");
+		char info[64];
+		int length = sprintf(info, "%lld %lld\n", size, (long long)time(NULL));
+		write_file(path, info, length);
+	}
+
+	bool read_info(const char* entry, long long* size, long long* last_used) {
+		char path[max_path_length];
+		join_path(path, entry, "info");
+		char info[64];
+		if (read_file(path, info, sizeof(info)) < 0) return false;
+		return sscanf(info, "%lld %lld", size, last_used) == 2;
+	}
+
+	void add_repository(Manifest* manifest, const char* path, const char* relative_path);
+
+	struct SubmoduleWalk {
+		Manifest* manifest;
+		const char* relative_path;
+	};
+
+	int add_submodule(git_submodule* sub, const char* name_, void* payload) {
+		SubmoduleWalk* walk = (SubmoduleWalk*)payload;
+		git_repository* parent = git_submodule_owner(sub);
+		char path[max_path_length];
+		strcpy(path, git_repository_workdir(parent));
+		strcat(path, git_submodule_path(sub));
+
+		char relative_path[max_path_length];
+		if (strcmp(walk->relative_path, ".") == 0) {
+			strcpy(relative_path, git_submodule_path(sub));
+		}
+		else {
+			strcpy(relative_path, walk->relative_path);
+			strcat(relative_path, "/");
+			strcat(relative_path, git_submodule_path(sub));
+		}
+
+		add_repository(walk->manifest, path, relative_path);
+		return walk->manifest->valid ? 0 : 1;
+	}
+
+	bool is_clean(git_repository* repo) {
+		git_status_options options = GIT_STATUS_OPTIONS_INIT;
+		options.flags = GIT_STATUS_OPT_INCLUDE_UNTRACKED | GIT_STATUS_OPT_INCLUDE_IGNORED | GIT_STATUS_OPT_EXCLUDE_SUBMODULES;
+		git_status_list* status;
+		if (git_status_list_new(&status, repo, &options) != 0) return false;
+		bool clean = git_status_list_entrycount(status) == 0;
+		git_status_list_free(status);
+		return clean;
+	}
+
+	void add_repository(Manifest* manifest, const char* path, const char* relative_path) {
+		git_repository* repo = NULL;
+		git_reference* head = NULL;
+		git_remote* origin = NULL;
+		if (git_repository_open(&repo, path) != 0 || !is_clean(repo)
+			|| git_repository_head(&head, repo) != 0 || git_remote_lookup(&origin, repo, "origin") != 0) {
+			manifest->valid = false;
+		}
+		else {
+			char id[GIT_OID_HEXSZ + 1];
+			git_oid_tostr(id, sizeof(id), git_reference_target(head));
+			const char* url = git_remote_url(origin);
+			const char* branch = git_reference_shorthand(head);
+			int line_length = strlen(id) + strlen(branch) + strlen(url) + strlen(relative_path) + 4;
+			if (manifest->length + line_length >= max_manifest_length) {
+				manifest->valid = false;
+			}
+			else {
+				manifest->length += sprintf(&manifest->text[manifest->length], "%s %s %s %s\n", id, branch, url, relative_path);
+				SubmoduleWalk walk;
+				walk.manifest = manifest;
+				walk.relative_path = relative_path;
+				git_submodule_foreach(repo, add_submodule, &walk);
+			}
+		}
+		git_remote_free(origin);
+		git_reference_free(head);
+		git_repository_free(repo);
+	}
+
+	struct Lookup {
+		const char* dir;
+		const char* root_line;
+		const char* path;
+		bool restored;
+	};
+
+	// Every line after the first one has to match what the remote currently has.
+	bool remotes_match(char* manifest) {
+		char* line = strchr(manifest, '\n');
+		while (line != NULL && line[1] != 0) {
+			++line;
+			char id[GIT_OID_HEXSZ + 1];
+			char branch[max_name_length];
+			char url[max_url_length];
+			if (sscanf(line, "%40s %255s %4095s", id, branch, url) != 3) return false;
+			git_oid expected;
+			git_oid actual;
+			if (git_oid_fromstr(&expected, id) != 0) return false;
+			if (!remote_head_id(&actual, url, branch) || !git_oid_equal(&expected, &actual)) return false;
+			line = strchr(line, '\n');
+		}
+		return true;
+	}
+
+	int restore_entry(const char* name, bool dir, void* payload) {
+		Lookup* lookup = (Lookup*)payload;
+		if (!dir || ends_with(name, ".tmp")) return 0;
+
+		char entry[max_path_length];
+		join_path(entry, lookup->dir, name);
+		char manifest_path[max_path_length];
+		join_path(manifest_path, entry, "manifest");
+		char* manifest = new char[max_manifest_length];
+		bool match = read_file(manifest_path, manifest, max_manifest_length) > 0
+			&& starts_with(manifest, lookup->root_line) && remotes_match(manifest);
+		delete[] manifest;
+		if (!match) return 0;
+
+		char tree[max_path_length];
+		join_path(tree, entry, "tree");
+		if (!copy_tree(tree, lookup->path)) {
+			remove_tree(lookup->path);
+			return 0;
+		}
+
+		long long size, last_used;
+		if (read_info(entry, &size, &last_used)) write_info(entry, size);
+		lookup->restored = true;
+		return 1;
+	}
+
+	struct Snapshot {
+		char name[max_name_length];
+		long long size;
+		long long last_used;
+	};
+
+	struct Eviction {
+		Snapshot* snapshots;
+		int count;
+		const char* dir;
+	};
+
+	int collect_entry(const char* name, bool dir, void* payload) {
+		Eviction* eviction = (Eviction*)payload;
+		if (!dir || ends_with(name, ".tmp") || eviction->count >= max_snapshots) return 0;
+		char entry[max_path_length];
+		join_path(entry, eviction->dir, name);
+		Snapshot* snapshot = &eviction->snapshots[eviction->count];
+		if (!read_info(entry, &snapshot->size, &snapshot->last_used)) return 0;
+		strcpy(snapshot->name, name);
+		++eviction->count;
+		return 0;
+	}
+
+	void evict(const char* dir, long long limit) {
+		Eviction eviction;
+		eviction.snapshots = new Snapshot[max_snapshots];
+		eviction.count = 0;
+		eviction.dir = dir;
+		list_dir(dir, collect_entry, &eviction);
+
+		long long total = 0;
+		for (int i = 0; i < eviction.count; ++i) {
+			total += eviction.snapshots[i].size;
+		}
+		while (total > limit) {
+			int oldest = -1;
+			for (int i = 0; i < eviction.count; ++i) {
+				if (eviction.snapshots[i].size < 0) continue;
+				if (oldest < 0 || eviction.snapshots[i].last_used < eviction.snapshots[oldest].last_used) oldest = i;
+			}
+			if (oldest < 0) break;
+			char entry[max_path_length];
+			join_path(entry, dir, eviction.snapshots[oldest].name);
+			remove_tree(entry);
+			total -= eviction.snapshots[oldest].size;
+			eviction.snapshots[oldest].size = -1;
+		}
+		delete[] eviction.snapshots;
+	}
+}
+
+void record_snapshot(const char* path) {
+	if (config.snapshot_cache_size <= 0) return;
+
+	Manifest manifest;
+	manifest.text = new char[max_manifest_length];
+	manifest.length = 0;
+	manifest.valid = true;
+	add_repository(&manifest, path, ".");
+	if (!manifest.valid) {
+		printf("Not recording a snapshot of %s, it has local changes.\n", path);
+		delete[] manifest.text;
+		return;
+	}
+
+	git_oid key;
+	git_odb_hash(&key, manifest.text, manifest.length, GIT_OBJ_BLOB);
+	char key_name[GIT_OID_HEXSZ + 1];
+	git_oid_tostr(key_name, sizeof(key_name), &key);
+
+	char dir[max_path_length];
+	snapshots_dir(dir);
+	make_dir(dir);
+	char entry[max_path_length];
+	join_path(entry, dir, key_name);
+	long long size, last_used;
+	if (read_info(entry, &size, &last_used)) {
+		write_info(entry, size);
+		delete[] manifest.text;
+		return;
+	}
+
+	char temp[max_path_length];
+	strcpy(temp, entry);
+	strcat(temp, ".tmp");
+	remove_tree(temp);
+	char tree[max_path_length];
+	join_path(tree, temp, "tree");
+	char manifest_path[max_path_length];
+	join_path(manifest_path, temp, "manifest");
+	if (make_dir(temp) && copy_tree(path, tree) && write_file(manifest_path, manifest.text, manifest.length)) {
+		write_info(temp, tree_size(tree));
+		if (rename(temp, entry) == 0) printf("Recorded snapshot %s.\n", key_name);
+	}
+	remove_tree(temp);
+	delete[] manifest.text;
+
+	evict(dir, config.snapshot_cache_size);
+}
+
+bool restore_snapshot(const char* repo_name, const char* path, const char* branch) {
+	if (config.snapshot_cache_size <= 0) return false;
+
+	char url[max_url_length];
+	git_oid head;
+	if (!make_url(repo_name, url) || !remote_head_id(&head, url, branch)) return false;
+
+	char root_line[max_url_length + max_name_length + GIT_OID_HEXSZ + 8];
+	char id[GIT_OID_HEXSZ + 1];
+	git_oid_tostr(id, sizeof(id), &head);
+	sprintf(root_line, "%s %s %s .\n", id, branch, url);
+
+	char dir[max_path_length];
+	snapshots_dir(dir);
+	Lookup lookup;
+	lookup.dir = dir;
+	lookup.root_line = root_line;
+	lookup.path = path;
+	lookup.restored = false;
+	list_dir(dir, restore_entry, &lookup);
+	if (lookup.restored) printf("#%s: Restored from snapshot cache.\n", repo_name);
+	return lookup.restored;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Local cache of complete workspaces (a repository and all of its submodules),
+// keyed by the commits that were checked out. Enabled by "snapshotCacheSize"
+// (in megabytes) in options.json.
+
+// Stores the workspace at path unless it has local changes.
+void record_snapshot(const char* path);
+// Copies a cached workspace to path if the remote still points to the cached commits.
+bool restore_snapshot(const char* repo_name, const char* path, const char* branch);
@@ -0,0 +1,156 @@
+#include "constants.h"
+#include "timings.h"
+#include "filesystem.h"
+#include "memory_budget.h"
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+thread_local RepositoryStats* current_stats = 0;
+
+namespace {
+	const int max_timings = 1024;
+	// Assumed for repositories without history so they are not started last
+	const long long unknown_duration = 10000;
+	// Indexing a received pack keeps an entry per object and the delta bases it resolves in memory,
+	// the pack itself is read through the pack windows which the memory budget accounts for separately
+	const long long pack_bytes_per_memory_byte = 2;
+
+	struct Timing {
+		char name[max_name_length];
+		RepositoryStats stats;
+		char children[max_children_length];
+	};
+
+	Timing* timings = 0;
+	int timing_count = 0;
+	std::mutex timings_mutex;
+
+	Timing* find_timing(const char* repo_name) {
+		for (int i = 0; i < timing_count; ++i) {
+			if (strcmp(timings[i].name, repo_name) == 0) return &timings[i];
+		}
+		return 0;
+	}
+
+	void timings_path(char* path) {
+		join_path(path, data_dir, "timings.txt");
+	}
+
+	long long critical_path(const char* repo_name, bool clone, int depth) {
+		Timing* timing = find_timing(repo_name);
+		if (timing == 0) return unknown_duration;
+		long long own = clone ? timing->stats.clone_ms : timing->stats.fetch_ms + timing->stats.checkout_ms;
+		long long longest_child = 0;
+		if (depth < 16) {
+			char child[max_name_length];
+			const char* start = timing->children;
+			while (*start != 0) {
+				const char* end = strchr(start, ',');
+				size_t length = end != 0 ? end - start : strlen(start);
+				if (length > 0 && length < max_name_length) {
+					strncpy(child, start, length);
+					child[length] = 0;
+					long long duration = critical_path(child, clone, depth + 1);
+					if (duration > longest_child) longest_child = duration;
+				}
+				if (end == 0) break;
+				start = end + 1;
+			}
+		}
+		return own + longest_child;
+	}
+}
+
+long long now_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void sample_memory() {
+	if (current_stats == 0) return;
+	// Called from the transfer progress, reading the memory use is a system call
+	static thread_local long long last_sample = 0;
+	long long now = now_ms();
+	if (now - last_sample < 50) return;
+	last_sample = now;
+	long long memory = current_memory();
+	if (memory > current_stats->peak_memory) current_stats->peak_memory = memory;
+}
+
+void add_fetch_time(long long start_ms, long long bytes) {
+	if (current_stats == 0) return;
+	sample_memory();
+	current_stats->fetch_ms += now_ms() - start_ms;
+	current_stats->bytes += bytes;
+}
+
+void add_checkout_time(long long start_ms) {
+	if (current_stats == 0) return;
+	sample_memory();
+	current_stats->checkout_ms += now_ms() - start_ms;
+}
+
+void load_timings() {
+	if (timings == 0) timings = new Timing[max_timings];
+	char path[max_path_length];
+	timings_path(path);
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return;
+	char line[max_name_length + max_children_length + 128];
+	while (timing_count < max_timings && fgets(line, sizeof(line), file) != NULL) {
+		Timing* timing = &timings[timing_count];
+		if (sscanf(line, "%255s %lld %lld %lld %lld %4095s", timing->name, &timing->stats.clone_ms, &timing->stats.fetch_ms,
+			&timing->stats.checkout_ms, &timing->stats.bytes, timing->children) != 6) continue;
+		if (strcmp(timing->children, "-") == 0) timing->children[0] = 0;
+		++timing_count;
+	}
+	fclose(file);
+}
+
+void save_timings() {
+	char path[max_path_length];
+	timings_path(path);
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return;
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	for (int i = 0; i < timing_count; ++i) {
+		Timing* timing = &timings[i];
+		fprintf(file, "%s %lld %lld %lld %lld %s\n", timing->name, timing->stats.clone_ms, timing->stats.fetch_ms,
+			timing->stats.checkout_ms, timing->stats.bytes, timing->children[0] != 0 ? timing->children : "-");
+	}
+	fclose(file);
+}
+
+void record_timings(const char* repo_name, const RepositoryStats* stats, const char* children) {
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	Timing* timing = find_timing(repo_name);
+	if (timing == 0) {
+		if (timings == 0 || timing_count >= max_timings) return;
+		timing = &timings[timing_count++];
+		strcpy(timing->name, repo_name);
+	}
+	// A pull does not tell how long a clone takes and the other way around
+	if (stats->clone_ms > 0) {
+		timing->stats.clone_ms = stats->clone_ms;
+		timing->stats.bytes = stats->bytes;
+	}
+	else {
+		timing->stats.fetch_ms = stats->fetch_ms;
+		timing->stats.checkout_ms = stats->checkout_ms;
+		if (stats->bytes > timing->stats.bytes) timing->stats.bytes = stats->bytes;
+	}
+	strncpy(timing->children, children, max_children_length - 1);
+	timing->children[max_children_length - 1] = 0;
+}
+
+long long estimated_duration(const char* repo_name, bool clone) {
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	return critical_path(repo_name, clone, 0);
+}
+
+long long estimated_memory(const char* repo_name) {
+	std::lock_guard<std::mutex> lock(timings_mutex);
+	Timing* timing = find_timing(repo_name);
+	return timing != 0 ? timing->stats.bytes / pack_bytes_per_memory_byte : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Durations in milliseconds, measured for the repository the current thread works on.
+struct RepositoryStats {
+	long long clone_ms;
+	long long fetch_ms;
+	long long checkout_ms;
+	long long bytes;
+	// Of the whole process while the repository was worked on
+	long long peak_memory;
+
+	RepositoryStats() {
+		clone_ms = 0;
+		fetch_ms = 0;
+		checkout_ms = 0;
+		bytes = 0;
+		peak_memory = 0;
+	}
+};
+
+extern thread_local RepositoryStats* current_stats;
+
+long long now_ms();
+void add_fetch_time(long long start_ms, long long bytes);
+void add_checkout_time(long long start_ms);
+void sample_memory();
+
+// Kept in <data>/timings.txt across runs.
+void load_timings();
+void save_timings();
+// children is a comma separated list of submodule repositories.
+void record_timings(const char* repo_name, const RepositoryStats* stats, const char* children);
+// Expected time until the repository and all of its submodules are done.
+long long estimated_duration(const char* repo_name, bool clone);
+// Memory a job for the repository needs, by the size of the packs it received in earlier runs.
+long long estimated_memory(const char* repo_name);
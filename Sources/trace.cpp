@@ -0,0 +1,119 @@
+#include "constants.h"
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+bool trace_enabled = false;
+
+namespace {
+	struct TraceEvent {
+		const char* span;
+		char repo_name[max_name_length];
+		int thread;
+		long long start_us;
+		long long duration_us;
+	};
+
+	char trace_path[max_path_length];
+	TraceEvent* events = 0;
+	int event_count = 0;
+	int event_capacity = 0;
+	std::mutex events_mutex;
+	std::chrono::steady_clock::time_point trace_start;
+	std::atomic<int> thread_count(0);
+	thread_local int trace_thread = -1;
+
+	void add_event(const char* span, const char* repo_name, long long start_us, long long duration_us) {
+		if (trace_thread < 0) trace_thread = thread_count++;
+
+		std::lock_guard<std::mutex> lock(events_mutex);
+		if (event_count == event_capacity) {
+			int capacity = event_capacity == 0 ? 1024 : event_capacity * 2;
+			TraceEvent* grown = new TraceEvent[capacity];
+			if (event_count > 0) memcpy(grown, events, event_count * sizeof(TraceEvent));
+			delete[] events;
+			events = grown;
+			event_capacity = capacity;
+		}
+		TraceEvent* event = &events[event_count++];
+		event->span = span;
+		strncpy(event->repo_name, repo_name != 0 ? repo_name : "", max_name_length - 1);
+		event->repo_name[max_name_length - 1] = 0;
+		event->thread = trace_thread;
+		event->start_us = start_us;
+		event->duration_us = duration_us;
+	}
+}
+
+void start_trace(const char* path) {
+	strcpy(trace_path, path);
+	trace_start = std::chrono::steady_clock::now();
+	trace_enabled = true;
+}
+
+long long trace_now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - trace_start).count();
+}
+
+void trace_span(const char* span, const char* repo_name, long long start_us) {
+	add_event(span, repo_name, start_us, trace_now_us() - start_us);
+}
+
+void trace_fetch_start(FetchTrace* fetch) {
+	if (!trace_enabled) return;
+	fetch->start_us = trace_now_us();
+	fetch->download_us = -1;
+	fetch->index_us = -1;
+}
+
+void trace_fetch_progress(FetchTrace* fetch, unsigned int received_objects, unsigned int total_objects) {
+	if (!trace_enabled) return;
+	if (fetch->download_us < 0) fetch->download_us = trace_now_us();
+	if (fetch->index_us < 0 && received_objects >= total_objects) fetch->index_us = trace_now_us();
+}
+
+void trace_fetch_end(FetchTrace* fetch, const char* repo_name) {
+	if (!trace_enabled) return;
+	// Nothing to download when no progress was reported
+	if (fetch->download_us < 0) {
+		trace_span("negotiate", repo_name, fetch->start_us);
+		return;
+	}
+	long long index_us = fetch->index_us < 0 ? trace_now_us() : fetch->index_us;
+	add_event("negotiate", repo_name, fetch->start_us, fetch->download_us - fetch->start_us);
+	add_event("download", repo_name, fetch->download_us, index_us - fetch->download_us);
+	add_event("index", repo_name, index_us, trace_now_us() - index_us);
+}
+
+void finish_trace() {
+	if (!trace_enabled) return;
+	trace_enabled = false;
+
+	FILE* file = fopen(trace_path, "wb");
+	if (file == NULL) {
+		fprintf(stderr, "Could not write trace to %s.\n", trace_path);
+		return;
+	}
+	fprintf(file, "{\"traceEvents\":[\n");
+	// Thread 0 is the main thread, it records the option parsing before any worker starts
+	int threads = thread_count;
+	for (int i = 0; i < threads; ++i) {
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s %i\"}}%s\n",
+			i, i == 0 ? "main" : "thread", i, i + 1 < threads || event_count > 0 ? "," : "");
+	}
+	for (int i = 0; i < event_count; ++i) {
+		TraceEvent* event = &events[i];
+		char repo_name[max_name_length * 2];
+		json_escape(repo_name, event->repo_name);
+		fprintf(file, "{\"name\":\"%s\",\"cat\":\"kitgit\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%lld,\"dur\":%lld,\"args\":{\"repository\":\"%s\"}}%s\n",
+			event->span, event->thread, event->start_us, event->duration_us, repo_name, i + 1 < event_count ? "," : "");
+	}
+	fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(file);
+	delete[] events;
+	events = 0;
+	event_count = event_capacity = 0;
+}
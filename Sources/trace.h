@@ -0,0 +1,42 @@
+#pragma once
+
+// Optional Chrome trace-event output (chrome://tracing, ui.perfetto.dev), enabled with --trace=<file>.
+// A disabled span costs one branch on trace_enabled.
+
+extern bool trace_enabled;
+
+void start_trace(const char* path);
+void finish_trace();
+
+long long trace_now_us();
+void trace_span(const char* span, const char* repo_name, long long start_us);
+
+class TraceSpan {
+public:
+	TraceSpan(const char* span, const char* repo_name) {
+		if (!trace_enabled) return;
+		this->span = span;
+		this->repo_name = repo_name;
+		start_us = trace_now_us();
+	}
+
+	~TraceSpan() {
+		if (trace_enabled) trace_span(span, repo_name, start_us);
+	}
+
+private:
+	const char* span;
+	const char* repo_name;
+	long long start_us;
+};
+
+// Splits a fetch into negotiate, download and index using the transfer progress.
+struct FetchTrace {
+	long long start_us;
+	long long download_us;
+	long long index_us;
+};
+
+void trace_fetch_start(FetchTrace* fetch);
+void trace_fetch_progress(FetchTrace* fetch, unsigned int received_objects, unsigned int total_objects);
+void trace_fetch_end(FetchTrace* fetch, const char* repo_name);
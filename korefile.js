@@ -35,7 +35,7 @@ if (platform === Platform.Windows) {
 	project.addIncludeDir('libgit2/deps/regex');
 	addLibFiles('deps/regex/regex.c');
 
-	project.addLibs('Crypt32', 'Winhttp', 'Rpcrt4');
+	project.addLibs('Crypt32', 'Winhttp', 'Rpcrt4', 'Psapi', 'Ws2_32');
 }
 else {
 	if (platform === Platform.OSX) {
@@ -52,6 +52,11 @@ else {
 	
 	//addLibFiles('src/hash/hash_generic.c');
 	addLibFiles('src/unix/*.c', 'src/unix/*.h');
+
+	project.addDefine('GIT_THREADS');
+	if (platform === Platform.Linux) {
+		project.addLib('pthread');
+	}
 }
 
 project.addIncludeDir('libgit2/deps/zlib');